@@ -1,3 +1,6 @@
+// 64 bit file offsets for fseeko on 32 bit hosts, disk images can be bigger than 2 GB
+#define _FILE_OFFSET_BITS 64
+
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
@@ -23,16 +26,266 @@
 #ifndef DWMWA_USE_IMMERSIVE_DARK_MODE
 #define DWMWA_USE_IMMERSIVE_DARK_MODE 20
 #endif
+
+#include <io.h>
+#include <fcntl.h>
 #endif
 
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <inttypes.h>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+
+// the mixer and the frame converter check the cpu at runtime, so their SIMD paths are built on every x86 target
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define HAVE_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET(isa)
+#else
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
 
 #define WIDTH 240
 #define HEIGHT 136
 #define SCALE 4
 #define PALETTE_SIZE 16
+#define CPU_CLOCK 10000000
+#define LINES_PER_FRAME (HEIGHT + 24) // visible lines followed by vblank
+
+// MEMORY MAP
+#define FB_START 0x0200
+#define FB_PAGE1 0x8000 // second framebuffer page for double buffering
+#define FB_SIZE (WIDTH * HEIGHT / 2)
+#define PROGRAM_START 0x41C0
+#define BANK_WINDOW 0xC000 // two 8 KB windows at $C000 and $E000, or one 16 KB window
+#define IO_START 0xFE00
+#define IO_PAGE (IO_START >> 8)
+
+#define DIRTY_SHIFT 6 // the bus tracks writes in 64 byte blocks, about a framebuffer row
+#define DIRTY_BLOCKS (0x10000 >> DIRTY_SHIFT)
+
+// tile mode reuses the framebuffer area as video ram
+#define TILE_PATTERNS 0x0200 // 256 tiles, 8x8 4bpp, 32 bytes each
+#define TILE_MAP 0x2200 // 64x32 tile indices
+#define TILE_MAP_WIDTH 64
+#define TILE_MAP_HEIGHT 32
+#define PATTERN_TEX_WIDTH 128
+#define PATTERN_TEX_HEIGHT (256 * 32 / PATTERN_TEX_WIDTH)
+
+// text mode cells are a character code followed by an attribute byte,
+// low nibble foreground and high nibble background color
+#define TEXT_CELLS 0x0200
+#define TEXT_COLUMNS 40
+#define TEXT_ROWS 17
+
+// IO REGISTERS
+#define REG_VMODE (IO_START + 0x00)
+#define REG_SCROLL_X (IO_START + 0x01) // 16 bit, little endian
+#define REG_SCROLL_Y (IO_START + 0x03) // 16 bit, little endian
+#define REG_FLIP (IO_START + 0x05) // bit 0 selects the displayed page at the next vblank, bit 7 reads 1 until then
+#define REG_DRAW_PAGE (IO_START + 0x06) // bit 0 selects the page the rasterizer draws into
+#define REG_MAP_CTRL (IO_START + 0x08)
+#define REG_BANK0 (IO_START + 0x09) // 16 bit, little endian
+#define REG_BANK1 (IO_START + 0x0B) // 16 bit, little endian
+
+#define REG_TIMER0 (IO_START + 0x10) // TIMER_* registers, 8 bytes per timer
+#define TIMER_COUNT 2
+
+#define REG_CYCLES (IO_START + 0x20) // 64 bit, reading the low byte latches all 8 bytes
+#define REG_INSTRUCTIONS (IO_START + 0x28) // 32 bit, latched like REG_CYCLES
+#define REG_FRAME (IO_START + 0x2C) // 32 bit, latched like REG_CYCLES
+#define REG_PROFILE_MARK (IO_START + 0x30) // writes log the cycle count on the host
+#define REG_LINE (IO_START + 0x34) // current beam line, read only
+#define REG_LINE_CMP (IO_START + 0x35) // line that raises the line interrupt
+#define REG_LINE_CTRL (IO_START + 0x36) // bit 0 enables the line interrupt
+#define REG_LINE_STATUS (IO_START + 0x37) // bit 0 set on a compare match, any write acknowledges
+#define REG_CONSOLE_OUT (IO_START + 0x38) // bytes written go to the host stdout
+#define REG_CONSOLE_IN (IO_START + 0x39) // next byte from the host stdin, 0 when there is none
+#define REG_CONSOLE_STATUS (IO_START + 0x3A) // bit 0 set while REG_CONSOLE_IN has a byte, read only
+#define REG_RASTER (IO_START + 0x40) // RASTER_* registers
+#define REG_PALETTE (IO_START + 0x50) // 16 RGB triplets, 48 bytes, latched per line like the scroll registers
+#define REG_DISK (IO_START + 0x80) // DISK_* registers
+#define REG_KEYS (IO_START + 0x90) // 8x8 key matrix, one row per byte, a set bit is held down, read only
+#define REG_PAD0 (IO_START + 0x98) // PAD_* registers, 8 bytes per pad, read only
+#define PAD_COUNT 2
+#define REG_PSG (IO_START + 0xB0) // PSG_* registers, 8 bytes per voice
+#define PSG_VOICES 4
+#define REG_PSG_WAVE (IO_START + 0xD0) // 32 4 bit samples for PSG_WAVETABLE, low nibble first
+#define REG_PCM (IO_START + 0xE0) // PCM_* registers, 8 bytes per channel
+#define PCM_CHANNELS 2
+#define REG_PAN (IO_START + 0xF0) // signed pan per voice, psg voices then pcm channels, 0 is centered
+
+// timer register offsets
+#define TIMER_RELOAD 0 // 16 bit, the counter runs from here down to 0
+#define TIMER_COUNTER 2 // 16 bit, reading the low byte latches the high byte
+#define TIMER_PRESCALE 4 // the counter steps every PRESCALE + 1 cycles
+#define TIMER_CTRL 5
+#define TIMER_STATUS 6 // bit 0 set on expiry, any write acknowledges
+
+// TIMER_CTRL bits
+#define TIMER_ENABLE 0x01
+#define TIMER_PERIODIC 0x02
+#define TIMER_IRQ 0x04
+
+// rasterizer register offsets, coordinates are signed 16 bit and clipped to the screen
+#define RASTER_X0 0
+#define RASTER_Y0 2
+#define RASTER_X1 4
+#define RASTER_Y1 6
+#define RASTER_X2 8
+#define RASTER_Y2 10
+#define RASTER_COLOR 12
+#define RASTER_CMD 13 // writing a command draws immediately and stalls the cpu
+
+// RASTER_CMD values
+#define RASTER_LINE 1 // (x0, y0) to (x1, y1), both ends inclusive
+#define RASTER_TRIANGLE 2 // filled, pixel centers inside the triangle
+
+#define RASTER_CYCLES_PER_PIXEL 1
+
+// disk register offsets
+#define DISK_SECTOR 0 // 32 bit, first sector of the transfer
+#define DISK_ADDRESS 4 // 16 bit, guest address the sectors land at
+#define DISK_COUNT 6 // sectors to transfer, at most DISK_MAX_SECTORS
+#define DISK_CMD 7 // writing a command starts the transfer
+#define DISK_CTRL 8 // bit 0 raises an irq on completion
+#define DISK_STATUS 9 // DISK_BUSY/DONE/ERROR, any write acknowledges DONE and ERROR
+
+// DISK_CMD values
+#define DISK_READ 1
+
+// DISK_STATUS bits
+#define DISK_BUSY 0x01
+#define DISK_DONE 0x02
+#define DISK_ERROR 0x04 // no disk image, or a command was given while busy
+
+#define DISK_SECTOR_SIZE 512
+#define DISK_MAX_SECTORS 128 // the whole address space
+#define DISK_SEEK_CYCLES 10000
+#define DISK_CYCLES_PER_SECTOR 5120
+
+// pad register offsets, latched at the start of every frame like REG_KEYS
+#define PAD_BUTTONS 0 // 16 bit, bit n is GLFW_GAMEPAD_BUTTON n, bit 15 is set while connected
+#define PAD_AXES 2 // 6 signed bytes, -127 to 127, in GLFW_GAMEPAD_AXIS order
+
+#define PAD_CONNECTED 0x8000
+
+// psg voice register offsets
+#define PSG_PERIOD 0 // 16 bit, the waveform steps every PERIOD + 1 cycles, 32 steps per cycle
+#define PSG_VOLUME 2 // 0 to 15
+#define PSG_WAVE 3 // PSG_PULSE/TRIANGLE/NOISE/WAVETABLE
+#define PSG_DUTY 4 // pulse high for the first DUTY of 32 steps
+#define PSG_CTRL 5 // bit 0 enables the voice and restarts its waveform
+
+// PSG_WAVE values
+#define PSG_PULSE 0
+#define PSG_TRIANGLE 1
+#define PSG_NOISE 2 // 15 bit lfsr clocked every step
+#define PSG_WAVETABLE 3
+
+#define NOISE_LENGTH 32767 // steps before the lfsr repeats
+
+// pcm channel register offsets, samples are signed 8 bit and read through the bus so
+// they can live in rom banks, the buffer is read as it is when the samples are rendered
+#define PCM_ADDRESS 0 // 16 bit
+#define PCM_LENGTH 2 // 16 bit, in samples
+#define PCM_PERIOD 4 // 16 bit, a new sample every PERIOD + 1 cycles
+#define PCM_VOLUME 6 // 0 to 15
+#define PCM_CTRL 7 // PCM_PLAY/LOOP
+
+// PCM_CTRL bits
+#define PCM_PLAY 0x01 // setting it starts from the first sample, cleared at the end unless looping
+#define PCM_LOOP 0x02
+
+#define PCM_FETCH_CYCLES 1 // bus cycles stolen from the cpu for every sample read
+
+#define SAMPLE_RATE 48000
+#define AUDIO_RING_FRAMES 8192
+#define AUDIO_BLOCK 256
+#define AUDIO_VOICES (PSG_VOICES + PCM_CHANNELS)
+
+#define MIX_VOICE_GAIN 0.25f // four voices at full volume reach full scale
+#define LIMIT_KNEE 0.8f // the limiter leaves anything quieter untouched
+
+// --audio-sync paces the emulation by the audio ring instead of the display
+#define AUDIO_TARGET_PERIODS 2.5 // ring fill the rate control steers towards, in device periods
+#define RATE_ADJUST_MAX 0.005 // largest fractional change of a frame's cycle budget
+#define FRAME_TIME_MAX 0.05 // longer host frames (stalls, window drags) are not caught up
+
+#define FRAME_RATE 60 // the emulation thread and headless runs use frames of CPU_CLOCK / 60 cycles
+#define INPUT_QUEUE_SIZE 1024 // bytes, a multiple of sizeof(InputEvent) so events never wrap
+
+// band-limited steps for the square voices
+#define BLIP_PHASES 32 // fractional sample positions
+#define BLIP_TAPS 16
+#define BLIP_SIZE 1024 // delta buffer, more than AUDIO_BLOCK + BLIP_TAPS samples
+#define BLIP_CUTOFF 0.9 // fraction of nyquist
+#define BLIP_LEAK 0.999f // the integrator slowly forgets, which also removes dc
+
+#define CONSOLE_OUT_SIZE 256 // flushed on newline, at the end of a frame or when full
+#define CONSOLE_IN_SIZE 256
+
+// REG_MAP_CTRL bits
+#define MAP_ENABLE0 0x01
+#define MAP_ENABLE1 0x02
+#define MAP_16K 0x04 // window 0 spans $C000-$FFFF, window 1 is ignored
+
+enum {
+	VMODE_BITMAP, // 4bpp 240x136
+	VMODE_TILE,
+	VMODE_HIRES, // 1bpp 480x272
+	VMODE_2BPP, // 240x136
+	VMODE_8BPP, // 240x136 RGB332 direct color, needs $0200-$817F so it can't flip
+	VMODE_TEXT, // 40x17 character cells of 6x8 pixels
+	VMODE_COUNT
+};
+
+#define HEX(hex) ((hex >> 16) & 0xFF), ((hex >> 8) & 0xFF), (hex & 0xFF)
+
+// Lost Century palette lospec, loaded into the palette registers on reset
+const uint8_t default_palette[PALETTE_SIZE * 3] = {
+	HEX(0x1a1c2c), HEX(0x5d275d), HEX(0xb13e53), HEX(0xef7d57),
+	HEX(0xffcd75), HEX(0xa7f070), HEX(0x38b764), HEX(0x257179),
+	HEX(0x29366f), HEX(0x3b5dc9), HEX(0x41a6f6), HEX(0x73eff7),
+	HEX(0xf4f4f4), HEX(0x94b0c2), HEX(0x566c86), HEX(0x333c57)
+};
+
+// 5x7 font for characters 32 to 127, one byte per column, bit 0 is the top row
+const uint8_t font_rom[96][5] = {
+	{ 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x5F, 0x00, 0x00 }, { 0x00, 0x07, 0x00, 0x07, 0x00 }, { 0x14, 0x7F, 0x14, 0x7F, 0x14 }, { 0x24, 0x2A, 0x7F, 0x2A, 0x12 }, { 0x23, 0x13, 0x08, 0x64, 0x62 }, { 0x36, 0x49, 0x55, 0x22, 0x50 }, { 0x00, 0x05, 0x03, 0x00, 0x00 },
+	{ 0x00, 0x1C, 0x22, 0x41, 0x00 }, { 0x00, 0x41, 0x22, 0x1C, 0x00 }, { 0x14, 0x08, 0x3E, 0x08, 0x14 }, { 0x08, 0x08, 0x3E, 0x08, 0x08 }, { 0x00, 0x50, 0x30, 0x00, 0x00 }, { 0x08, 0x08, 0x08, 0x08, 0x08 }, { 0x00, 0x60, 0x60, 0x00, 0x00 }, { 0x20, 0x10, 0x08, 0x04, 0x02 },
+	{ 0x3E, 0x51, 0x49, 0x45, 0x3E }, { 0x00, 0x42, 0x7F, 0x40, 0x00 }, { 0x42, 0x61, 0x51, 0x49, 0x46 }, { 0x21, 0x41, 0x45, 0x4B, 0x31 }, { 0x18, 0x14, 0x12, 0x7F, 0x10 }, { 0x27, 0x45, 0x45, 0x45, 0x39 }, { 0x3C, 0x4A, 0x49, 0x49, 0x30 }, { 0x01, 0x71, 0x09, 0x05, 0x03 },
+	{ 0x36, 0x49, 0x49, 0x49, 0x36 }, { 0x06, 0x49, 0x49, 0x29, 0x1E }, { 0x00, 0x36, 0x36, 0x00, 0x00 }, { 0x00, 0x56, 0x36, 0x00, 0x00 }, { 0x08, 0x14, 0x22, 0x41, 0x00 }, { 0x14, 0x14, 0x14, 0x14, 0x14 }, { 0x00, 0x41, 0x22, 0x14, 0x08 }, { 0x02, 0x01, 0x51, 0x09, 0x06 },
+	{ 0x32, 0x49, 0x79, 0x41, 0x3E }, { 0x7E, 0x11, 0x11, 0x11, 0x7E }, { 0x7F, 0x49, 0x49, 0x49, 0x36 }, { 0x3E, 0x41, 0x41, 0x41, 0x22 }, { 0x7F, 0x41, 0x41, 0x22, 0x1C }, { 0x7F, 0x49, 0x49, 0x49, 0x41 }, { 0x7F, 0x09, 0x09, 0x01, 0x01 }, { 0x3E, 0x41, 0x41, 0x51, 0x32 },
+	{ 0x7F, 0x08, 0x08, 0x08, 0x7F }, { 0x00, 0x41, 0x7F, 0x41, 0x00 }, { 0x20, 0x40, 0x41, 0x3F, 0x01 }, { 0x7F, 0x08, 0x14, 0x22, 0x41 }, { 0x7F, 0x40, 0x40, 0x40, 0x40 }, { 0x7F, 0x02, 0x04, 0x02, 0x7F }, { 0x7F, 0x04, 0x08, 0x10, 0x7F }, { 0x3E, 0x41, 0x41, 0x41, 0x3E },
+	{ 0x7F, 0x09, 0x09, 0x09, 0x06 }, { 0x3E, 0x41, 0x51, 0x21, 0x5E }, { 0x7F, 0x09, 0x19, 0x29, 0x46 }, { 0x46, 0x49, 0x49, 0x49, 0x31 }, { 0x01, 0x01, 0x7F, 0x01, 0x01 }, { 0x3F, 0x40, 0x40, 0x40, 0x3F }, { 0x1F, 0x20, 0x40, 0x20, 0x1F }, { 0x7F, 0x20, 0x18, 0x20, 0x7F },
+	{ 0x63, 0x14, 0x08, 0x14, 0x63 }, { 0x03, 0x04, 0x78, 0x04, 0x03 }, { 0x61, 0x51, 0x49, 0x45, 0x43 }, { 0x00, 0x7F, 0x41, 0x41, 0x00 }, { 0x02, 0x04, 0x08, 0x10, 0x20 }, { 0x00, 0x41, 0x41, 0x7F, 0x00 }, { 0x04, 0x02, 0x01, 0x02, 0x04 }, { 0x40, 0x40, 0x40, 0x40, 0x40 },
+	{ 0x00, 0x01, 0x02, 0x04, 0x00 }, { 0x20, 0x54, 0x54, 0x54, 0x78 }, { 0x7F, 0x48, 0x44, 0x44, 0x38 }, { 0x38, 0x44, 0x44, 0x44, 0x20 }, { 0x38, 0x44, 0x44, 0x48, 0x7F }, { 0x38, 0x54, 0x54, 0x54, 0x18 }, { 0x08, 0x7E, 0x09, 0x01, 0x02 }, { 0x08, 0x14, 0x54, 0x54, 0x3C },
+	{ 0x7F, 0x08, 0x04, 0x04, 0x78 }, { 0x00, 0x44, 0x7D, 0x40, 0x00 }, { 0x20, 0x40, 0x44, 0x3D, 0x00 }, { 0x00, 0x7F, 0x10, 0x28, 0x44 }, { 0x00, 0x41, 0x7F, 0x40, 0x00 }, { 0x7C, 0x04, 0x18, 0x04, 0x78 }, { 0x7C, 0x08, 0x04, 0x04, 0x78 }, { 0x38, 0x44, 0x44, 0x44, 0x38 },
+	{ 0x7C, 0x14, 0x14, 0x14, 0x08 }, { 0x08, 0x14, 0x14, 0x18, 0x7C }, { 0x7C, 0x08, 0x04, 0x04, 0x08 }, { 0x48, 0x54, 0x54, 0x54, 0x20 }, { 0x04, 0x3F, 0x44, 0x40, 0x20 }, { 0x3C, 0x40, 0x40, 0x20, 0x7C }, { 0x1C, 0x20, 0x40, 0x20, 0x1C }, { 0x3C, 0x40, 0x30, 0x40, 0x3C },
+	{ 0x44, 0x28, 0x10, 0x28, 0x44 }, { 0x0C, 0x50, 0x50, 0x50, 0x3C }, { 0x44, 0x64, 0x54, 0x4C, 0x44 }, { 0x00, 0x08, 0x36, 0x41, 0x00 }, { 0x00, 0x00, 0x7F, 0x00, 0x00 }, { 0x00, 0x41, 0x36, 0x08, 0x00 }, { 0x02, 0x01, 0x02, 0x04, 0x02 }, { 0x7F, 0x7F, 0x7F, 0x7F, 0x7F }
+};
+
+// glfw keys by matrix position, row by row
+const int key_matrix[64] = {
+	GLFW_KEY_A, GLFW_KEY_B, GLFW_KEY_C, GLFW_KEY_D, GLFW_KEY_E, GLFW_KEY_F, GLFW_KEY_G, GLFW_KEY_H,
+	GLFW_KEY_I, GLFW_KEY_J, GLFW_KEY_K, GLFW_KEY_L, GLFW_KEY_M, GLFW_KEY_N, GLFW_KEY_O, GLFW_KEY_P,
+	GLFW_KEY_Q, GLFW_KEY_R, GLFW_KEY_S, GLFW_KEY_T, GLFW_KEY_U, GLFW_KEY_V, GLFW_KEY_W, GLFW_KEY_X,
+	GLFW_KEY_Y, GLFW_KEY_Z, GLFW_KEY_0, GLFW_KEY_1, GLFW_KEY_2, GLFW_KEY_3, GLFW_KEY_4, GLFW_KEY_5,
+	GLFW_KEY_6, GLFW_KEY_7, GLFW_KEY_8, GLFW_KEY_9, GLFW_KEY_SPACE, GLFW_KEY_ENTER, GLFW_KEY_BACKSPACE, GLFW_KEY_TAB,
+	GLFW_KEY_ESCAPE, GLFW_KEY_LEFT, GLFW_KEY_RIGHT, GLFW_KEY_UP, GLFW_KEY_DOWN, GLFW_KEY_LEFT_SHIFT, GLFW_KEY_RIGHT_SHIFT, GLFW_KEY_LEFT_CONTROL,
+	GLFW_KEY_RIGHT_CONTROL, GLFW_KEY_LEFT_ALT, GLFW_KEY_RIGHT_ALT, GLFW_KEY_MINUS, GLFW_KEY_EQUAL, GLFW_KEY_LEFT_BRACKET, GLFW_KEY_RIGHT_BRACKET, GLFW_KEY_BACKSLASH,
+	GLFW_KEY_SEMICOLON, GLFW_KEY_APOSTROPHE, GLFW_KEY_COMMA, GLFW_KEY_PERIOD, GLFW_KEY_SLASH, GLFW_KEY_GRAVE_ACCENT, GLFW_KEY_F1, GLFW_KEY_F2
+};
 
 const char *vertex_source =
 	"#version 330 core\n"
@@ -44,26 +297,97 @@ const char *vertex_source =
 	"    TexCoord = aTexCoord;\n"
 	"}\n";
 
-const char *fragment_source =
+// fragment shaders are assembled from a shared header, a per-mode pixel_color()
+// and a shared main that applies the crt effect
+const char *fragment_header =
 	"#version 330 core\n"
 	"out vec4 FragColor;\n"
 	"in vec2 TexCoord;\n"
-	"uniform sampler1D pal_tex;\n"
-	"uniform sampler2D fb_tex;\n"
-	"uniform int fb_width;\n"
+	"uniform sampler2D pal_tex;\n"
+	"uniform ivec2 screen_size;\n"
 	"uniform float warp;\n"
 	"uniform float scan;\n"
-	"void main() {\n"
-	"    vec2 texel = TexCoord * vec2(fb_width, textureSize(fb_tex, 0).y);\n"
-	"    ivec2 pixel = ivec2(floor(texel));\n"
-	"    float index_byte = int(texelFetch(fb_tex, pixel, 0).r * 255.0);\n"
+	"int line;\n"
+	"vec4 palette(int index) {\n"
+	"    return texelFetch(pal_tex, ivec2(index, line), 0);\n"
+	"}\n";
+
+// 4bpp packed bitmap, low nibble is the left pixel
+const char *bitmap_source =
+	"uniform sampler2D fb_tex;\n"
+	"vec4 pixel_color(ivec2 pixel) {\n"
+	"    int index_byte = int(texelFetch(fb_tex, ivec2(pixel.x / 2, pixel.y), 0).r * 255.0);\n"
 	"    int color_index;\n"
-	"    if (int(texel.x * 2.0) % 2 == 0) {\n"
-	"        color_index = int(index_byte) & 0x0F;\n"
+	"    if (pixel.x % 2 == 0) {\n"
+	"        color_index = index_byte & 0x0F;\n"
 	"    } else {\n"
-	"        color_index = (int(index_byte) >> 4) & 0x0F;\n"
+	"        color_index = (index_byte >> 4) & 0x0F;\n"
 	"    }\n"
-	"    vec4 color = texelFetch(pal_tex, color_index, 0);\n"
+	"    return palette(color_index);\n"
+	"}\n";
+
+// 1bpp packed bitmap using palette entries 0 and 1, low bit is the left pixel
+const char *hires_source =
+	"uniform usampler2D fb_tex;\n"
+	"vec4 pixel_color(ivec2 pixel) {\n"
+	"    uint bits = texelFetch(fb_tex, ivec2(pixel.x / 8, pixel.y), 0).r;\n"
+	"    return palette(int((bits >> (pixel.x % 8)) & 1u));\n"
+	"}\n";
+
+// 2bpp packed bitmap using palette entries 0 to 3, low bits are the left pixel
+const char *bitmap_2bpp_source =
+	"uniform usampler2D fb_tex;\n"
+	"vec4 pixel_color(ivec2 pixel) {\n"
+	"    uint bits = texelFetch(fb_tex, ivec2(pixel.x / 4, pixel.y), 0).r;\n"
+	"    return palette(int((bits >> ((pixel.x % 4) * 2)) & 3u));\n"
+	"}\n";
+
+// one RGB332 byte per pixel, unpacked by the texture format
+const char *bitmap_8bpp_source =
+	"uniform sampler2D fb_tex;\n"
+	"vec4 pixel_color(ivec2 pixel) {\n"
+	"    return vec4(texelFetch(fb_tex, pixel, 0).rgb, 1.0);\n"
+	"}\n";
+
+// 8x8 4bpp tiles addressed through a wrapping 64x32 tilemap, scrolled per line
+const char *tile_source =
+	"uniform sampler2D pattern_tex;\n"
+	"uniform sampler2D map_tex;\n"
+	"uniform usampler2D line_tex;\n"
+	"vec4 pixel_color(ivec2 pixel) {\n"
+	"    uvec4 line = texelFetch(line_tex, ivec2(0, pixel.y), 0);\n"
+	"    ivec2 p = pixel + ivec2(line.r | (line.g << 8), line.b | (line.a << 8));\n"
+	"    ivec2 cell = (p >> 3) & ivec2(63, 31);\n"
+	"    int tile = int(texelFetch(map_tex, cell, 0).r * 255.0);\n"
+	"    int offset = tile * 32 + (p.y & 7) * 4 + (p.x & 7) / 2;\n"
+	"    int index_byte = int(texelFetch(pattern_tex, ivec2(offset % 128, offset / 128), 0).r * 255.0);\n"
+	"    int color_index;\n"
+	"    if ((p.x & 1) == 0) {\n"
+	"        color_index = index_byte & 0x0F;\n"
+	"    } else {\n"
+	"        color_index = (index_byte >> 4) & 0x0F;\n"
+	"    }\n"
+	"    return palette(color_index);\n"
+	"}\n";
+
+// character cells looked up in the built in font, the 6th column is spacing
+const char *text_source =
+	"uniform usampler2D cell_tex;\n"
+	"uniform usampler2D font_tex;\n"
+	"vec4 pixel_color(ivec2 pixel) {\n"
+	"    ivec2 cell = pixel / ivec2(6, 8);\n"
+	"    ivec2 inner = pixel % ivec2(6, 8);\n"
+	"    uvec2 code = texelFetch(cell_tex, cell, 0).rg;\n"
+	"    uint column = inner.x < 5 ? texelFetch(font_tex, ivec2(inner.x, int(code.r)), 0).r : 0u;\n"
+	"    uint color_index = ((column >> inner.y) & 1u) != 0u ? code.g & 15u : code.g >> 4;\n"
+	"    return palette(int(color_index));\n"
+	"}\n";
+
+const char *fragment_main =
+	"void main() {\n"
+	"    ivec2 pixel = ivec2(floor(TexCoord * vec2(screen_size)));\n"
+	"    line = pixel.y * textureSize(pal_tex, 0).y / screen_size.y;\n"
+	"    vec4 color = pixel_color(pixel);\n"
 	"    vec2 uv = TexCoord;\n"
 	"    vec2 dc = abs(0.5 - uv) * abs(0.5 - uv);"
 	"    uv.x -= 0.5;\n"
@@ -80,53 +404,1823 @@ const char *fragment_source =
 	"    }\n"
 	"}\n";
 
-GLFWwindow *window;
-unsigned int shader_program;
-unsigned int vao;
-unsigned int pal_texture, fb_texture;
-uint8_t fb[WIDTH * HEIGHT / 2];
+typedef struct {
+	int width, height; // pixels
+	int pitch; // bytes per row and texture width, 0 when the mode isn't a plain bitmap
+	int internal_format, format, type;
+} VideoMode;
+
+const VideoMode video_modes[VMODE_COUNT] = {
+	[VMODE_BITMAP] = { WIDTH, HEIGHT, WIDTH / 2, GL_R8, GL_RED, GL_UNSIGNED_BYTE },
+	[VMODE_TILE] = { WIDTH, HEIGHT, 0 },
+	[VMODE_HIRES] = { WIDTH * 2, HEIGHT * 2, WIDTH * 2 / 8, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE },
+	[VMODE_2BPP] = { WIDTH, HEIGHT, WIDTH / 4, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE },
+	[VMODE_8BPP] = { WIDTH, HEIGHT, WIDTH, GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE_3_3_2 },
+	[VMODE_TEXT] = { WIDTH, HEIGHT, 0 },
+};
+
+GLFWwindow *window;
+unsigned int shader_programs[VMODE_COUNT];
+unsigned int vao;
+unsigned int pal_texture;
+unsigned int fb_textures[VMODE_COUNT]; // one per bitmap mode
+unsigned int pattern_texture, map_texture, line_texture;
+unsigned int cell_texture, font_texture;
+int last_vmode = -1;
+int uploaded_base = -1; // framebuffer page currently held by fb_textures[last_vmode]
+
+// video memory goes to the textures through a ring of pixel buffers, the buffer written this
+// frame was last read by the gpu a few frames ago so the fence wait is normally free
+#define UPLOAD_BUFFERS 3
+// a frame never uploads a video memory address twice, the line tables come on top
+#define UPLOAD_BUFFER_SIZE (0x10000 + HEIGHT * (PALETTE_SIZE * 3 + 4))
+#define UPLOAD_SPANS 256
+
+typedef struct {
+	unsigned int texture;
+	int row, width, rows;
+	GLenum format, type;
+	uint32_t offset;
+} UploadSpan;
+
+unsigned int upload_buffers[UPLOAD_BUFFERS];
+GLsync upload_fences[UPLOAD_BUFFERS];
+int upload_index;
+uint8_t *upload_data; // mapped buffer being filled, NULL outside draw()
+uint32_t upload_size;
+UploadSpan upload_spans[UPLOAD_SPANS];
+int upload_span_count;
+
+uint32_t uploaded_frame; // video frame the textures were last brought up to
+uint64_t pending_releases; // key matrix bits whose release didn't fit in the queue yet
+uint32_t upload_bytes; // texture data uploaded since the last stats line
+ma_timer upload_timer;
+double upload_time, upload_wait; // cpu time spent uploading and waiting on fences, same period
+bool show_stats;
+
+bool is_fullscreen = false;
+int prev_x, prev_y, prev_w, prev_h;
+static int get_current_monitor(void);
+static void toggle_fullscreen(void);
+
+// EMULATION STUFF
+extern uint16_t pc;
+extern uint8_t sp, a, x, y, status;
+extern uint32_t clockticks6502, clockgoal6502;
+extern uint32_t instructions;
+void reset6502(void);
+void exec6502(uint32_t tick_count);
+void step6502(void);
+void irq6502(void);
+void nmi6502(void);
+void hookexternal(void *funcptr);
+
+#define FLAG_INTERRUPT 0x04
+
+// irq sources, the cpu irq line is asserted while any bit is set
+#define IRQ_TIMER0 0x01 // one bit per timer
+#define IRQ_DISK 0x40
+#define IRQ_LINE 0x80
+
+typedef struct {
+	bool running;
+	uint64_t start; // cycle the current period began
+	uint64_t expire; // cycle the counter passes 0
+	uint32_t divider;
+	uint16_t reload; // latched when the period starts, TIMER_RELOAD may change under it
+} Timer;
+
+Timer timers[TIMER_COUNT];
+uint8_t irq_line;
+uint64_t next_event = UINT64_MAX; // earliest pending device event
+
+uint64_t cycle_base; // cycle count when clockticks6502 was 0, both counters restart every slice
+
+uint32_t frame_number;
+uint64_t last_mark_cycle;
+int display_page; // latched from REG_FLIP at vblank
+
+uint64_t frame_start;
+uint32_t frame_cycles;
+bool line_irq_armed; // compare line still ahead of the beam this frame
+
+// the disk image is only read by the io thread, the guest sees the data
+// when the transfer completes at its scheduled cycle
+FILE *disk_file;
+ma_event disk_request, disk_done;
+uint8_t disk_buffer[DISK_MAX_SECTORS * DISK_SECTOR_SIZE];
+uint32_t disk_sector, disk_size; // request for the io thread
+uint16_t disk_address;
+bool disk_busy;
+uint64_t disk_complete; // cycle the transfer lands in guest ram
+
+typedef struct {
+	bool enabled;
+	uint8_t step; // position in the 32 step waveform
+	uint16_t noise; // position in the lfsr sequence
+	uint64_t next_step; // cycle of the next step
+	float level; // output already recorded in the delta buffer
+} Voice;
+
+typedef struct {
+	bool playing;
+	uint64_t start; // cycle of the first sample
+	uint64_t fetched; // samples read so far
+} PcmChannel;
+
+// samples are rendered up to the current cycle on every sound register write and at the end of
+// each frame, then handed to the audio callback through a lock-free ring
+Voice voices[PSG_VOICES];
+PcmChannel pcm_channels[PCM_CHANNELS];
+uint64_t audio_samples; // samples rendered so far, sample n plays at cycle n * CPU_CLOCK / SAMPLE_RATE
+uint64_t psg_cycle; // band-limited voices have run up to here
+float blip_kernel[BLIP_PHASES][BLIP_TAPS];
+float blip_buffer[PSG_VOICES][BLIP_SIZE]; // amplitude deltas by output sample
+float blip_level[PSG_VOICES]; // running sum of the deltas read out so far
+uint16_t noise_ones[NOISE_LENGTH + 1]; // high lfsr outputs before each position, from reset
+float voice_blocks[AUDIO_VOICES][AUDIO_BLOCK]; // every source renders its own block, then they're mixed
+float mix_gains[AUDIO_VOICES][2]; // left and right
+ma_pcm_rb audio_ring;
+ma_device audio_device;
+bool audio_open;
+bool audio_sync;
+
+enum {
+	INPUT_KEY, // index is the key matrix bit, value is 1 while held
+	INPUT_STEP, // single steps the cpu and dumps its state
+};
+
+typedef struct {
+	uint8_t type;
+	uint8_t index;
+	uint64_t value;
+} InputEvent;
+
+// queued by the render thread, applied at the start of the next emulated frame
+ma_rb input_queue;
+uint64_t host_keys;
+// pads are a snapshot rather than events, so a full queue can't lose their state
+volatile ma_uint64 host_pads[PAD_COUNT]; // PAD_* register bytes, little endian
+
+// the emulation thread runs at its own pace and hands finished frames to the render thread
+ma_thread emulation_thread;
+volatile ma_uint32 emulation_running;
+
+// console output waiting to be written, console input filled by a host thread
+char console_out[CONSOLE_OUT_SIZE];
+int console_out_length;
+FILE *console_stream; // stdout, or stderr while stdout carries raw audio, runtime messages go here too
+ma_rb console_in;
+bool console_in_started;
+
+// scroll and palette registers as they were at the start of each visible line
+uint8_t line_table[HEIGHT][4];
+uint8_t line_palettes[HEIGHT][PALETTE_SIZE * 3];
+int latched_lines; // lines of the current frame already in line_table
+bool line_table_dirty = true; // some line differs from the last published frame
+
+uint8_t ram[1 << 16];
+bool block_dirty[DIRTY_BLOCKS]; // set on every write, cleared when the frame is published
+
+// what the renderer needs from one emulated frame, blocks are stamped with the
+// frame that last wrote them so a renderer that skipped frames still sees every change
+typedef struct {
+	uint32_t frame;
+	uint8_t ram[1 << 16];
+	uint32_t block_frame[DIRTY_BLOCKS];
+	uint32_t line_table_frame;
+	uint8_t line_table[HEIGHT][4];
+	uint8_t line_palettes[HEIGHT][PALETTE_SIZE * 3];
+	int display_page;
+} VideoFrame;
+
+#define VIDEO_FRESH 0x04 // the shared slot holds a frame the renderer hasn't taken yet
+
+// triple buffer, the emulation writes video_back, the renderer reads video_front and
+// the third slot is swapped between them through video_ready
+VideoFrame video_frames[3];
+volatile ma_uint32 video_ready = 1;
+int video_back = 0, video_front = 2;
+uint32_t video_sequence; // frames published so far
+uint32_t block_frame[DIRTY_BLOCKS];
+uint32_t line_table_frame;
+
+// 256 byte page tables, a NULL write page is read only (rom) or the io page
+uint8_t *read_pages[256];
+uint8_t *write_pages[256];
+
+// the whole rom image stays resident, banks are views into it
+uint8_t *rom_image;
+uint32_t rom_image_size; // multiple of 16 KB
+
+static uint8_t io_read(uint16_t address);
+static void io_write(uint16_t address, uint8_t value);
+
+uint8_t read6502(uint16_t address) {
+	uint8_t *page = read_pages[address >> 8];
+	if (page) {
+		return page[address & 0xFF];
+	}
+	return io_read(address);
+}
+
+void write6502(uint16_t address, uint8_t value) {
+	uint8_t *page = write_pages[address >> 8];
+	if (page) {
+		page[address & 0xFF] = value;
+		block_dirty[address >> DIRTY_SHIFT] = true;
+	} else if ((address >> 8) == IO_PAGE) {
+		io_write(address, value);
+	}
+}
+
+static void mark_dirty(uint16_t address, uint32_t size) {
+	int first = address >> DIRTY_SHIFT;
+	int last = (address + size - 1) >> DIRTY_SHIFT;
+	memset(&block_dirty[first], true, last - first + 1);
+}
+
+// points a window of pages at a rom bank, or back at ram when disabled
+static void map_window(int first_page, int page_count, bool enabled, uint32_t bank) {
+	uint32_t bank_size = page_count * 256;
+	uint32_t offset = (bank * bank_size) % rom_image_size;
+
+	for (int i = 0; i < page_count; i++) {
+		int page = first_page + i;
+		if (page == IO_PAGE) continue;
+
+		if (enabled) {
+			read_pages[page] = rom_image + offset + i * 256;
+			write_pages[page] = NULL;
+		} else {
+			read_pages[page] = &ram[page << 8];
+			write_pages[page] = &ram[page << 8];
+		}
+	}
+}
+
+static void update_mapper(void) {
+	uint8_t ctrl = ram[REG_MAP_CTRL];
+	uint16_t bank0 = ram[REG_BANK0] | (ram[REG_BANK0 + 1] << 8);
+	uint16_t bank1 = ram[REG_BANK1] | (ram[REG_BANK1 + 1] << 8);
+	int window_pages = 0x2000 >> 8;
+
+	if (ctrl & MAP_16K) {
+		map_window(BANK_WINDOW >> 8, window_pages * 2, ctrl & MAP_ENABLE0, bank0);
+	} else {
+		map_window(BANK_WINDOW >> 8, window_pages, ctrl & MAP_ENABLE0, bank0);
+		map_window((BANK_WINDOW >> 8) + window_pages, window_pages, ctrl & MAP_ENABLE1, bank1);
+	}
+}
+
+// CONSOLE
+static void console_flush(void) {
+	if (console_out_length) {
+		fwrite(console_out, 1, console_out_length, console_stream);
+		fflush(console_stream);
+		console_out_length = 0;
+	}
+}
+
+static void console_write(uint8_t value) {
+	console_out[console_out_length++] = value;
+	if (value == '\n' || console_out_length == CONSOLE_OUT_SIZE) {
+		console_flush();
+	}
+}
+
+// blocks on stdin so the emulation never has to
+static ma_thread_result MA_THREADCALL console_in_thread(void *data) {
+	int c;
+	while ((c = fgetc(stdin)) != EOF) {
+		// wait for the guest to make room instead of dropping input
+		while (ma_rb_available_write(&console_in) == 0) {
+			ma_sleep(1);
+		}
+
+		size_t size = 1;
+		void *buffer;
+		ma_rb_acquire_write(&console_in, &size, &buffer);
+		*(uint8_t *) buffer = c;
+		ma_rb_commit_write(&console_in, 1);
+	}
+	return (ma_thread_result) 0;
+}
+
+// stdin is only taken over once the guest first asks for input
+static void console_in_start(void) {
+	if (console_in_started) return;
+	console_in_started = true;
+
+	ma_thread thread;
+	if (ma_rb_init(CONSOLE_IN_SIZE, NULL, NULL, &console_in) != MA_SUCCESS
+		|| ma_thread_create(&thread, ma_thread_priority_normal, 0, console_in_thread, NULL, NULL) != MA_SUCCESS) {
+		fprintf(console_stream, "Error starting console input\n");
+	}
+}
+
+static uint8_t console_read(void) {
+	console_in_start();
+	if (ma_rb_available_read(&console_in) == 0) return 0;
+
+	size_t size = 1;
+	void *buffer;
+	ma_rb_acquire_read(&console_in, &size, &buffer);
+	uint8_t value = *(uint8_t *) buffer;
+	ma_rb_commit_read(&console_in, 1);
+	return value;
+}
+
+// TIMELINE
+static uint64_t cycles_now(void) {
+	return cycle_base + clockticks6502;
+}
+
+// ends the current exec6502 slice after this instruction so events get rescheduled
+static void timeline_break(void) {
+	clockgoal6502 = clockticks6502;
+}
+
+// runs the cpu until the target cycle or until a device breaks the slice
+static void run_until(uint64_t target) {
+	// the goal trails the tick count by however much the last instruction overshot
+	uint64_t now = cycles_now();
+	int32_t ahead = (int32_t) (clockgoal6502 - clockticks6502);
+	uint32_t overshoot = ahead < 0 ? (uint32_t) -ahead : 0;
+
+	// the core compares its 32 bit counters without wrapping, so they're kept near 0
+	cycle_base = now - overshoot;
+	clockticks6502 = overshoot;
+	clockgoal6502 = overshoot + ahead;
+
+	uint64_t goal = cycle_base + clockgoal6502;
+	if (target > goal) {
+		exec6502((uint32_t) (target - goal));
+	}
+}
+
+static void poll_irq(void) {
+	if (!irq_line) {
+		hookexternal(NULL);
+	} else if (!(status & FLAG_INTERRUPT)) {
+		irq6502();
+	}
+}
+
+// the line is level triggered, while it is asserted the cpu checks it after every instruction
+static void update_irq(void) {
+	if (irq_line) {
+		hookexternal(poll_irq);
+		poll_irq();
+	}
+}
+
+static void update_devices(uint64_t now);
+static void latch_input(void);
+
+// TIMERS
+static void timer_start(int i, uint64_t now) {
+	uint8_t *regs = &ram[REG_TIMER0 + i * 8];
+	Timer *timer = &timers[i];
+
+	timer->reload = regs[TIMER_RELOAD] | (regs[TIMER_RELOAD + 1] << 8);
+	timer->divider = regs[TIMER_PRESCALE] + 1;
+	timer->start = now;
+	timer->expire = now + (uint64_t) (timer->reload + 1) * timer->divider;
+	timer->running = true;
+}
+
+// counters are never stepped, they are derived from the cycle count when read
+static uint16_t timer_counter(int i) {
+	Timer *timer = &timers[i];
+	uint64_t now = cycles_now();
+	if (!timer->running || now >= timer->expire) return 0;
+
+	return timer->reload - (uint16_t) ((now - timer->start) / timer->divider);
+}
+
+static void update_timers(uint64_t now) {
+	for (int i = 0; i < TIMER_COUNT; i++) {
+		uint8_t *regs = &ram[REG_TIMER0 + i * 8];
+		Timer *timer = &timers[i];
+		if (!timer->running) continue;
+
+		if (timer->expire <= now) {
+			regs[TIMER_STATUS] |= 0x01;
+			if (regs[TIMER_CTRL] & TIMER_IRQ) irq_line |= IRQ_TIMER0 << i;
+
+			if (regs[TIMER_CTRL] & TIMER_PERIODIC) {
+				// restart from the expiry cycle, not from now, so periods don't drift
+				timer_start(i, timer->expire);
+				if (timer->expire <= now) timer_start(i, now);
+			} else {
+				timer->running = false;
+				regs[TIMER_CTRL] &= ~TIMER_ENABLE;
+				continue;
+			}
+		}
+
+		if (timer->expire < next_event) next_event = timer->expire;
+	}
+}
+
+static void timer_write(int i, int reg, uint8_t value) {
+	switch (reg) {
+		case TIMER_CTRL:
+			if (value & TIMER_ENABLE) {
+				timer_start(i, cycles_now());
+			} else {
+				timers[i].running = false;
+			}
+			update_devices(cycles_now());
+			timeline_break();
+			break;
+		case TIMER_STATUS:
+			ram[REG_TIMER0 + i * 8 + TIMER_STATUS] = 0;
+			irq_line &= ~(IRQ_TIMER0 << i);
+			break;
+	}
+}
+
+static uint8_t timer_read(int i, int reg) {
+	uint8_t *regs = &ram[REG_TIMER0 + i * 8];
+
+	if (reg == TIMER_COUNTER) {
+		uint16_t counter = timer_counter(i);
+		regs[TIMER_COUNTER + 1] = counter >> 8;
+		return counter & 0xFF;
+	}
+
+	return regs[reg];
+}
+
+// BEAM
+static uint64_t line_cycle(int line) {
+	return frame_start + (uint64_t) line * frame_cycles / LINES_PER_FRAME;
+}
+
+static int beam_line(uint64_t now) {
+	if (frame_cycles == 0) return 0;
+	int line = (int) ((now - frame_start) * LINES_PER_FRAME / frame_cycles);
+	return line < LINES_PER_FRAME ? line : LINES_PER_FRAME - 1;
+}
+
+// fills the line table up to the given line with the current register values,
+// called before any latched register changes so earlier lines keep the old ones
+static void latch_lines(int line) {
+	for (; latched_lines < line && latched_lines < HEIGHT; latched_lines++) {
+		if (memcmp(line_table[latched_lines], &ram[REG_SCROLL_X], 4) != 0) {
+			memcpy(line_table[latched_lines], &ram[REG_SCROLL_X], 4);
+			line_table_dirty = true;
+		}
+		if (memcmp(line_palettes[latched_lines], &ram[REG_PALETTE], PALETTE_SIZE * 3) != 0) {
+			memcpy(line_palettes[latched_lines], &ram[REG_PALETTE], PALETTE_SIZE * 3);
+			line_table_dirty = true;
+		}
+	}
+}
+
+static void arm_line_irq(uint64_t now) {
+	line_irq_armed = (ram[REG_LINE_CTRL] & 0x01) && ram[REG_LINE_CMP] < LINES_PER_FRAME
+		&& line_cycle(ram[REG_LINE_CMP]) >= now;
+}
+
+static void update_beam(uint64_t now) {
+	if (!line_irq_armed) return;
+
+	uint64_t cycle = line_cycle(ram[REG_LINE_CMP]);
+	if (cycle <= now) {
+		ram[REG_LINE_STATUS] |= 0x01;
+		irq_line |= IRQ_LINE;
+		line_irq_armed = false;
+	} else if (cycle < next_event) {
+		next_event = cycle;
+	}
+}
+
+// DISK
+static ma_thread_result MA_THREADCALL disk_thread(void *data) {
+	while (true) {
+		ma_event_wait(&disk_request);
+
+		// long is 32 bits on windows, sectors past 2 GB need a 64 bit seek
+#ifdef _WIN32
+		_fseeki64(disk_file, (int64_t) disk_sector * DISK_SECTOR_SIZE, SEEK_SET);
+#else
+		fseeko(disk_file, (off_t) disk_sector * DISK_SECTOR_SIZE, SEEK_SET);
+#endif
+		size_t read = fread(disk_buffer, 1, disk_size, disk_file);
+		memset(disk_buffer + read, 0, disk_size - read); // past the end of the image reads as 0
+
+		ma_event_signal(&disk_done);
+	}
+	return (ma_thread_result) 0;
+}
+
+static void disk_open(const char *path) {
+	disk_file = fopen(path, "rb");
+	if (!disk_file) return;
+
+	ma_thread thread;
+	ma_event_init(&disk_request);
+	ma_event_init(&disk_done);
+	if (ma_thread_create(&thread, ma_thread_priority_normal, 0, disk_thread, NULL, NULL) != MA_SUCCESS) {
+		fprintf(console_stream, "Error starting disk thread\n");
+		fclose(disk_file);
+		disk_file = NULL;
+	}
+}
+
+static void disk_finish(uint8_t status) {
+	ram[REG_DISK + DISK_STATUS] = status;
+	if (ram[REG_DISK + DISK_CTRL] & 0x01) irq_line |= IRQ_DISK;
+}
+
+static void disk_command(uint8_t command) {
+	uint8_t *regs = &ram[REG_DISK];
+	if (command != DISK_READ) return;
+
+	if (!disk_file || disk_busy) {
+		disk_finish(regs[DISK_STATUS] | DISK_ERROR);
+		timeline_break();
+		return;
+	}
+
+	int count = regs[DISK_COUNT] < DISK_MAX_SECTORS ? regs[DISK_COUNT] : DISK_MAX_SECTORS;
+	disk_sector = regs[DISK_SECTOR] | (regs[DISK_SECTOR + 1] << 8) | (regs[DISK_SECTOR + 2] << 16) | ((uint32_t) regs[DISK_SECTOR + 3] << 24);
+	disk_size = count * DISK_SECTOR_SIZE;
+	disk_address = regs[DISK_ADDRESS] | (regs[DISK_ADDRESS + 1] << 8);
+
+	// the completion cycle only depends on the request, never on how fast the host is
+	disk_complete = cycles_now() + DISK_SEEK_CYCLES + (uint64_t) count * DISK_CYCLES_PER_SECTOR;
+	disk_busy = true;
+	regs[DISK_STATUS] = DISK_BUSY;
+	ma_event_signal(&disk_request);
+
+	update_devices(cycles_now());
+	timeline_break();
+}
+
+// copies the sectors through the write page table, so rom windows and the io page are skipped
+static void disk_dma(void) {
+	uint32_t done = 0;
+	while (done < disk_size) {
+		uint16_t address = disk_address + done;
+		uint32_t chunk = 256 - (address & 0xFF);
+		if (chunk > disk_size - done) chunk = disk_size - done;
+
+		uint8_t *page = write_pages[address >> 8];
+		if (page) {
+			memcpy(page + (address & 0xFF), disk_buffer + done, chunk);
+			mark_dirty(address, chunk);
+		}
+		done += chunk;
+	}
+}
+
+static void update_disk(uint64_t now) {
+	if (!disk_busy) return;
+
+	if (disk_complete > now) {
+		if (disk_complete < next_event) next_event = disk_complete;
+		return;
+	}
+
+	// a host read slower than the emulated disk stalls here instead of changing the timing
+	ma_event_wait(&disk_done);
+	disk_dma();
+	disk_busy = false;
+	disk_finish(DISK_DONE);
+}
+
+static void update_devices(uint64_t now) {
+	next_event = UINT64_MAX;
+	update_timers(now);
+	update_beam(now);
+	update_disk(now);
+}
+
+// VIDEO FRAMES
+// called at vblank, copies the blocks written since the back slot last held a frame
+static void video_publish(void) {
+	video_sequence++;
+	for (int block = 0; block < DIRTY_BLOCKS; block++) {
+		if (block_dirty[block]) {
+			block_frame[block] = video_sequence;
+			block_dirty[block] = false;
+		}
+	}
+	if (line_table_dirty) {
+		line_table_frame = video_sequence;
+		line_table_dirty = false;
+	}
+
+	VideoFrame *video = &video_frames[video_back];
+	for (int block = 0; block < DIRTY_BLOCKS; block++) {
+		if (block_frame[block] > video->frame) {
+			memcpy(&video->ram[block << DIRTY_SHIFT], &ram[block << DIRTY_SHIFT], 1 << DIRTY_SHIFT);
+		}
+	}
+	memcpy(&video->ram[IO_START], &ram[IO_START], 0x100); // io writes aren't tracked
+	memcpy(video->block_frame, block_frame, sizeof(block_frame));
+	memcpy(video->line_table, line_table, sizeof(line_table));
+	memcpy(video->line_palettes, line_palettes, sizeof(line_palettes));
+	video->line_table_frame = line_table_frame;
+	video->display_page = display_page;
+	video->frame = video_sequence;
+
+	video_back = ma_atomic_exchange_32(&video_ready, video_back | VIDEO_FRESH) & ~VIDEO_FRESH;
+}
+
+// the newest published frame, or the one already held when nothing new arrived
+static VideoFrame *video_acquire(void) {
+	if (ma_atomic_load_32(&video_ready) & VIDEO_FRESH) {
+		video_front = ma_atomic_exchange_32(&video_ready, video_front) & ~VIDEO_FRESH;
+	}
+	return &video_frames[video_front];
+}
+
+// SOUND
+static uint64_t sample_cycle(uint64_t sample) {
+	return sample * CPU_CLOCK / SAMPLE_RATE;
+}
+
+// -1 to 1 before volume
+static float voice_level(int i) {
+	uint8_t *regs = &ram[REG_PSG + i * 8];
+	Voice *voice = &voices[i];
+	int step = voice->step;
+
+	switch (regs[PSG_WAVE]) {
+		case PSG_PULSE:
+			return step < regs[PSG_DUTY] ? 1.0f : -1.0f;
+		case PSG_TRIANGLE:
+			return step < 16 ? step / 7.5f - 1.0f : 1.0f - (step - 16) / 7.5f;
+		case PSG_NOISE:
+			return noise_ones[voice->noise + 1] > noise_ones[voice->noise] ? 1.0f : -1.0f;
+		case PSG_WAVETABLE:
+			return ((ram[REG_PSG_WAVE + step / 2] >> (step & 1) * 4) & 0x0F) / 7.5f - 1.0f;
+	}
+	return 0.0f;
+}
+
+static float voice_output(int i) {
+	if (!voices[i].enabled) return 0.0f;
+	return voice_level(i) * (ram[REG_PSG + i * 8 + PSG_VOLUME] & 0x0F) / 15.0f;
+}
+
+// square edges go through the delta buffer, the other waveforms are point sampled
+static bool band_limited(int i) {
+	uint8_t wave = ram[REG_PSG + i * 8 + PSG_WAVE];
+	return wave == PSG_PULSE || wave == PSG_NOISE;
+}
+
+// adds a band-limited step of the given height at the exact cycle it happens
+static void blip_add(int i, uint64_t cycle, float delta) {
+	uint64_t sample = cycle * SAMPLE_RATE / CPU_CLOCK;
+	int phase = (int) ((cycle * SAMPLE_RATE % CPU_CLOCK) * BLIP_PHASES / CPU_CLOCK);
+	const float *kernel = blip_kernel[phase];
+
+	for (int k = 0; k < BLIP_TAPS; k++) {
+		blip_buffer[i][(sample + k) % BLIP_SIZE] += delta * kernel[k];
+	}
+}
+
+// records a delta if the voice's output changed
+static void voice_level_at(int i, uint64_t cycle, float level) {
+	Voice *voice = &voices[i];
+	if (level != voice->level) {
+		blip_add(i, cycle, level - voice->level);
+		voice->level = level;
+	}
+}
+
+static void voice_edge(int i, uint64_t cycle) {
+	voice_level_at(i, cycle, band_limited(i) ? voice_output(i) : 0.0f);
+}
+
+// high outputs in the first count positions of the waveform, counted from the start
+static uint64_t voice_ones(int i, uint64_t count) {
+	if (ram[REG_PSG + i * 8 + PSG_WAVE] == PSG_NOISE) {
+		return count / NOISE_LENGTH * noise_ones[NOISE_LENGTH] + noise_ones[count % NOISE_LENGTH];
+	}
+	uint64_t duty = ram[REG_PSG + i * 8 + PSG_DUTY] < 32 ? ram[REG_PSG + i * 8 + PSG_DUTY] : 32;
+	return count / 32 * duty + (count % 32 < duty ? count % 32 : duty);
+}
+
+// average output over the next steps, what a run of edges shorter than a sample sounds like
+static float voice_mean(int i, uint64_t steps) {
+	uint64_t start = (ram[REG_PSG + i * 8 + PSG_WAVE] == PSG_NOISE ? voices[i].noise : voices[i].step) + 1;
+	float high = (float) (voice_ones(i, start + steps) - voice_ones(i, start)) / steps;
+	return (high * 2.0f - 1.0f) * (ram[REG_PSG + i * 8 + PSG_VOLUME] & 0x0F) / 15.0f;
+}
+
+// band-limited voices cost one iteration per edge, pulse jumps straight to the next one. edges
+// closer together than a sample are folded into one delta to their average, so a short period
+// costs no more than one delta per output sample
+static void voice_advance(int i, uint64_t cycle) {
+	uint8_t *regs = &ram[REG_PSG + i * 8];
+	Voice *voice = &voices[i];
+	uint32_t length = (regs[PSG_PERIOD] | (regs[PSG_PERIOD + 1] << 8)) + 1;
+
+	while (voice->next_step <= cycle) {
+		uint64_t reachable = (cycle - voice->next_step) / length + 1;
+		uint64_t steps = reachable; // point sampled voices only need where they end up
+		bool folded = false;
+		float mean = 0.0f;
+
+		if (band_limited(i)) {
+			steps = 1;
+			if (regs[PSG_WAVE] == PSG_PULSE) {
+				steps = voice->step < regs[PSG_DUTY] ? regs[PSG_DUTY] - voice->step : 32 - voice->step;
+			}
+
+			// the last cycle that still lands in the same output sample as this step
+			uint64_t sample = voice->next_step * SAMPLE_RATE / CPU_CLOCK;
+			uint64_t last = ((sample + 1) * CPU_CLOCK + SAMPLE_RATE - 1) / SAMPLE_RATE - 1;
+			uint64_t same_sample = (last - voice->next_step) / length + 1;
+			if (steps < same_sample) {
+				// a part of the window would average to a spike, wait until all of it has run
+				if (last > cycle) break;
+				steps = same_sample;
+				mean = voice_mean(i, steps);
+				folded = true;
+			}
+			if (steps > reachable) steps = reachable;
+		}
+
+		uint64_t at = voice->next_step + (steps - 1) * length;
+		voice->step = (voice->step + steps) & 31;
+		if (regs[PSG_WAVE] == PSG_NOISE) voice->noise = (voice->noise + steps) % NOISE_LENGTH;
+		voice->next_step = at + length;
+
+		if (folded) voice_level_at(i, at, mean);
+		else if (band_limited(i)) voice_edge(i, at);
+	}
+}
+
+// drops whatever doesn't fit, the callback side never waits on the emulation
+static void audio_push(const int16_t *frames, uint32_t count) {
+	while (count) {
+		ma_uint32 size = count;
+		void *buffer;
+		ma_pcm_rb_acquire_write(&audio_ring, &size, &buffer);
+		if (size == 0) return;
+
+		memcpy(buffer, frames, size * 2 * sizeof(int16_t));
+		ma_pcm_rb_commit_write(&audio_ring, size);
+		frames += size * 2;
+		count -= size;
+	}
+}
+
+// out = a + (b - a) * t
+static void pcm_lerp(float *out, const float *a, const float *b, const float *t, uint32_t count) {
+	uint32_t n = 0;
+#ifdef HAVE_SSE2
+	for (; n + 4 <= count; n += 4) {
+		__m128 va = _mm_loadu_ps(a + n);
+		_mm_storeu_ps(out + n, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(b + n), va), _mm_loadu_ps(t + n))));
+	}
+#endif
+	for (; n < count; n++) {
+		out[n] = a[n] + (b[n] - a[n]) * t[n];
+	}
+}
+
+static float pcm_fetch(uint16_t address) {
+	uint8_t *page = read_pages[address >> 8];
+	return page ? (int8_t) page[address & 0xFF] / 128.0f : 0.0f;
+}
+
+// resamples every channel into its block, then charges the fetches to the cpu
+static void pcm_render(uint64_t first, uint32_t count) {
+	float a[AUDIO_BLOCK], b[AUDIO_BLOCK], t[AUDIO_BLOCK];
+
+	for (int i = 0; i < PCM_CHANNELS; i++) {
+		uint8_t *regs = &ram[REG_PCM + i * 8];
+		PcmChannel *channel = &pcm_channels[i];
+		float *block = voice_blocks[PSG_VOICES + i];
+		if (!channel->playing) {
+			memset(block, 0, count * sizeof(float));
+			continue;
+		}
+
+		uint16_t address = regs[PCM_ADDRESS] | (regs[PCM_ADDRESS + 1] << 8);
+		uint16_t length = regs[PCM_LENGTH] | (regs[PCM_LENGTH + 1] << 8);
+		uint32_t period = (regs[PCM_PERIOD] | (regs[PCM_PERIOD + 1] << 8)) + 1;
+		bool loop = regs[PCM_CTRL] & PCM_LOOP;
+		uint64_t fetched = channel->fetched;
+
+		for (uint32_t n = 0; n < count; n++) {
+			uint64_t cycle = sample_cycle(first + n);
+			if (cycle < channel->start) {
+				a[n] = b[n] = t[n] = 0.0f;
+				continue;
+			}
+
+			uint64_t elapsed = cycle - channel->start;
+			uint64_t index = elapsed / period;
+			if (length == 0 || (index >= length && !loop)) {
+				channel->playing = false;
+				regs[PCM_CTRL] &= ~PCM_PLAY;
+				for (; n < count; n++) a[n] = b[n] = t[n] = 0.0f;
+				break;
+			}
+
+			uint64_t next = index + 1;
+			if (next >= length && !loop) next = index;
+			a[n] = pcm_fetch(address + (uint16_t) (index % length));
+			b[n] = pcm_fetch(address + (uint16_t) (next % length));
+			t[n] = (float) (elapsed % period) / period;
+			fetched = index + 1;
+		}
+
+		pcm_lerp(block, a, b, t, count);
+
+		// the dma shares the bus, every sample it read held the cpu off for a moment
+		clockticks6502 += (uint32_t) (fetched - channel->fetched) * PCM_FETCH_CYCLES;
+		channel->fetched = fetched;
+	}
+}
+
+// CPU FEATURES
+enum {
+	CPU_SSE2 = 1,
+	CPU_SSSE3 = 2,
+	CPU_AVX2 = 4,
+};
+
+// what this cpu runs, checked once
+static int cpu_features(void) {
+	static int features = -1;
+	if (features >= 0) return features;
+
+	features = 0;
+#if defined(HAVE_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	bool avx_state = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6; // the os saves the ymm registers
+	if (info[3] & (1 << 26)) features |= CPU_SSE2;
+	if (info[2] & (1 << 9)) features |= CPU_SSSE3;
+	__cpuidex(info, 7, 0);
+	if (avx_state && (info[1] & (1 << 5))) features |= CPU_AVX2;
+#elif defined(HAVE_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) features |= CPU_SSE2;
+	if (__builtin_cpu_supports("ssse3")) features |= CPU_SSSE3;
+	if (__builtin_cpu_supports("avx2")) features |= CPU_AVX2;
+#endif
+	return features;
+}
+
+// MIXER
+// every path adds the voices in the same order with the same operations, so they are bit exact
+static float limit(float x) {
+	float magnitude = fabsf(x);
+	float over = fmaxf(magnitude - LIMIT_KNEE, 0.0f) / (1.0f - LIMIT_KNEE);
+	float y = fminf(magnitude, LIMIT_KNEE) + (1.0f - LIMIT_KNEE) * over / (1.0f + over);
+	return copysignf(y, x);
+}
+
+static void mix_scalar(int16_t *out, uint32_t count) {
+	for (uint32_t n = 0; n < count; n++) {
+		float left = 0.0f;
+		float right = 0.0f;
+		for (int v = 0; v < AUDIO_VOICES; v++) {
+			left += voice_blocks[v][n] * mix_gains[v][0];
+			right += voice_blocks[v][n] * mix_gains[v][1];
+		}
+
+		out[n * 2] = (int16_t) lrintf(limit(left) * 32767.0f);
+		out[n * 2 + 1] = (int16_t) lrintf(limit(right) * 32767.0f);
+	}
+}
+
+#ifdef HAVE_X86
+TARGET("sse2") static __m128 limit_sse2(__m128 x) {
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128 knee = _mm_set1_ps(LIMIT_KNEE);
+	const __m128 range = _mm_set1_ps(1.0f - LIMIT_KNEE);
+
+	__m128 magnitude = _mm_andnot_ps(sign, x);
+	__m128 over = _mm_div_ps(_mm_max_ps(_mm_sub_ps(magnitude, knee), _mm_setzero_ps()), range);
+	__m128 y = _mm_add_ps(_mm_min_ps(magnitude, knee), _mm_div_ps(_mm_mul_ps(range, over), _mm_add_ps(_mm_set1_ps(1.0f), over)));
+	return _mm_or_ps(y, _mm_and_ps(sign, x));
+}
+
+// count is a multiple of 4
+TARGET("sse2") static void mix_sse2(int16_t *out, uint32_t count) {
+	const __m128 scale = _mm_set1_ps(32767.0f);
+
+	for (uint32_t n = 0; n < count; n += 4) {
+		__m128 left = _mm_setzero_ps();
+		__m128 right = _mm_setzero_ps();
+		for (int v = 0; v < AUDIO_VOICES; v++) {
+			__m128 samples = _mm_loadu_ps(&voice_blocks[v][n]);
+			left = _mm_add_ps(left, _mm_mul_ps(samples, _mm_set1_ps(mix_gains[v][0])));
+			right = _mm_add_ps(right, _mm_mul_ps(samples, _mm_set1_ps(mix_gains[v][1])));
+		}
+		left = limit_sse2(left);
+		right = limit_sse2(right);
+
+		// interleave to left, right pairs and pack with saturation
+		__m128i low = _mm_cvtps_epi32(_mm_mul_ps(_mm_unpacklo_ps(left, right), scale));
+		__m128i high = _mm_cvtps_epi32(_mm_mul_ps(_mm_unpackhi_ps(left, right), scale));
+		_mm_storeu_si128((__m128i *) &out[n * 2], _mm_packs_epi32(low, high));
+	}
+}
+
+TARGET("avx2") static __m256 limit_avx2(__m256 x) {
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m256 knee = _mm256_set1_ps(LIMIT_KNEE);
+	const __m256 range = _mm256_set1_ps(1.0f - LIMIT_KNEE);
+
+	__m256 magnitude = _mm256_andnot_ps(sign, x);
+	__m256 over = _mm256_div_ps(_mm256_max_ps(_mm256_sub_ps(magnitude, knee), _mm256_setzero_ps()), range);
+	__m256 y = _mm256_add_ps(_mm256_min_ps(magnitude, knee), _mm256_div_ps(_mm256_mul_ps(range, over), _mm256_add_ps(_mm256_set1_ps(1.0f), over)));
+	return _mm256_or_ps(y, _mm256_and_ps(sign, x));
+}
+
+// count is a multiple of 8
+TARGET("avx2") static void mix_avx2(int16_t *out, uint32_t count) {
+	const __m256 scale = _mm256_set1_ps(32767.0f);
+
+	for (uint32_t n = 0; n < count; n += 8) {
+		__m256 left = _mm256_setzero_ps();
+		__m256 right = _mm256_setzero_ps();
+		for (int v = 0; v < AUDIO_VOICES; v++) {
+			__m256 samples = _mm256_loadu_ps(&voice_blocks[v][n]);
+			left = _mm256_add_ps(left, _mm256_mul_ps(samples, _mm256_set1_ps(mix_gains[v][0])));
+			right = _mm256_add_ps(right, _mm256_mul_ps(samples, _mm256_set1_ps(mix_gains[v][1])));
+		}
+		left = limit_avx2(left);
+		right = limit_avx2(right);
+
+		// unpack and pack both stay within 128 bit lanes, so the pairs come out in order
+		__m256i low = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_unpacklo_ps(left, right), scale));
+		__m256i high = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_unpackhi_ps(left, right), scale));
+		_mm256_storeu_si256((__m256i *) &out[n * 2], _mm256_packs_epi32(low, high));
+	}
+}
+#endif
+
+typedef void (*MixBlock)(int16_t *out, uint32_t count);
+
+typedef struct {
+	const char *name;
+	MixBlock mix;
+	uint32_t lanes; // count is rounded up to a multiple of this
+	int features; // CPU_* bits the path needs
+} MixPath;
+
+enum { MIX_SCALAR, MIX_SSE2, MIX_AVX2, MIX_PATHS };
+
+const MixPath mix_paths[MIX_PATHS] = {
+	[MIX_SCALAR] = { "scalar", mix_scalar, 1, 0 },
+#ifdef HAVE_X86
+	[MIX_SSE2] = { "SSE2", mix_sse2, 4, CPU_SSE2 },
+	[MIX_AVX2] = { "AVX2", mix_avx2, 8, CPU_AVX2 },
+#endif
+};
+
+static bool mix_path_runs(int path) {
+	return mix_paths[path].mix && (cpu_features() & mix_paths[path].features) == mix_paths[path].features;
+}
+
+// the best path this cpu runs, checked once
+static int mix_best_path(void) {
+	static int best = -1;
+	if (best >= 0) return best;
+
+	best = MIX_SCALAR;
+	for (int path = 0; path < MIX_PATHS; path++) {
+		if (mix_path_runs(path)) best = path;
+	}
+	return best;
+}
+
+static void mix_path(int path, int16_t *out, uint32_t count) {
+	uint32_t lanes = mix_paths[path].lanes;
+	mix_paths[path].mix(out, (count + lanes - 1) / lanes * lanes);
+}
+
+// mixes whole blocks, samples past count are mixed too and thrown away
+static void mix_block(int16_t *out, uint32_t count) {
+	mix_path(mix_best_path(), out, count);
+}
+
+static void update_mix_gains(void) {
+	for (int v = 0; v < AUDIO_VOICES; v++) {
+		float gain = MIX_VOICE_GAIN;
+		if (v >= PSG_VOICES) gain *= (ram[REG_PCM + (v - PSG_VOICES) * 8 + PCM_VOLUME] & 0x0F) / 15.0f;
+
+		float pan = (int8_t) ram[REG_PAN + v] / 128.0f;
+		mix_gains[v][0] = gain * (pan > 0.0f ? 1.0f - pan : 1.0f);
+		mix_gains[v][1] = gain * (pan < 0.0f ? 1.0f + pan : 1.0f);
+	}
+}
+
+static void bench_mixer(void) {
+	uint32_t seed = 1;
+	for (int v = 0; v < AUDIO_VOICES; v++) {
+		for (int n = 0; n < AUDIO_BLOCK; n++) {
+			seed = seed * 1664525 + 1013904223;
+			voice_blocks[v][n] = (int32_t) seed / 2147483648.0f;
+		}
+		mix_gains[v][0] = 0.3f;
+		mix_gains[v][1] = 0.2f;
+	}
+
+	int16_t reference[AUDIO_BLOCK * 2];
+	int16_t out[AUDIO_BLOCK * 2];
+	mix_scalar(reference, AUDIO_BLOCK);
+
+	// every path this cpu can run, each timed on whole blocks and checked against scalar
+	const int iterations = 100000;
+	for (int path = 0; path < MIX_PATHS; path++) {
+		if (!mix_path_runs(path)) continue;
+		mix_path(path, out, AUDIO_BLOCK);
+		bool exact = memcmp(reference, out, sizeof(out)) == 0;
+
+		ma_timer timer;
+		ma_timer_init(&timer);
+		double start = ma_timer_get_time_in_seconds(&timer);
+		for (int i = 0; i < iterations; i++) {
+			mix_path(path, out, AUDIO_BLOCK);
+		}
+		double elapsed = ma_timer_get_time_in_seconds(&timer) - start;
+
+		printf("%s mixer: %.1f mixed samples/us, %s the scalar output\n", mix_paths[path].name,
+			(double) iterations * AUDIO_BLOCK * AUDIO_VOICES / (elapsed * 1e6), exact ? "matches" : "differs from");
+	}
+	printf("audio uses the %s mixer\n", mix_paths[mix_best_path()].name);
+}
+
+// renders every sample that plays before the given cycle, a block at a time so the
+// delta buffer never wraps onto samples that haven't been read out yet
+static void audio_render(uint64_t now) {
+	while (psg_cycle < now) {
+		uint64_t cycle = sample_cycle(audio_samples + AUDIO_BLOCK);
+		if (cycle > now) cycle = now;
+
+		for (int i = 0; i < PSG_VOICES; i++) {
+			if (voices[i].enabled && band_limited(i)) voice_advance(i, cycle);
+		}
+		psg_cycle = cycle;
+
+		// edges before psg_cycle can land as early as this sample, everything before it is final
+		uint64_t first = audio_samples;
+		uint32_t count = (uint32_t) (psg_cycle * SAMPLE_RATE / CPU_CLOCK - first);
+
+		for (int i = 0; i < PSG_VOICES; i++) {
+			bool point_sampled = voices[i].enabled && !band_limited(i);
+			for (uint32_t n = 0; n < count; n++) {
+				float *delta = &blip_buffer[i][(first + n) % BLIP_SIZE];
+				blip_level[i] = blip_level[i] * BLIP_LEAK + *delta;
+				*delta = 0.0f;
+
+				float sample = blip_level[i];
+				if (point_sampled) {
+					voice_advance(i, sample_cycle(first + n));
+					sample += voice_output(i);
+				}
+				voice_blocks[i][n] = sample;
+			}
+		}
+		pcm_render(first, count);
+		audio_samples += count;
+
+		int16_t frames[AUDIO_BLOCK * 2];
+		update_mix_gains();
+		mix_block(frames, count);
+		audio_push(frames, count);
+	}
+}
+
+static void psg_write(int i, int reg, uint8_t value) {
+	Voice *voice = &voices[i];
+	if (reg == PSG_CTRL) {
+		voice->enabled = value & 0x01;
+		voice->step = 0;
+		voice->noise = 0;
+		voice->next_step = cycles_now() + (ram[REG_PSG + i * 8 + PSG_PERIOD] | (ram[REG_PSG + i * 8 + PSG_PERIOD + 1] << 8)) + 1;
+	}
+
+	// volume, waveform and duty changes are edges too
+	voice_edge(i, cycles_now());
+}
+
+static void pcm_write(int i, int reg, uint8_t value) {
+	if (reg != PCM_CTRL) return;
+
+	PcmChannel *channel = &pcm_channels[i];
+	channel->playing = value & PCM_PLAY;
+	channel->start = cycles_now();
+	channel->fetched = 0;
+}
+
+// builds the windowed sinc impulses for every fractional position, the output lags by
+// half the kernel so the impulse never reaches back into samples already read out
+static void blip_init(void) {
+	for (int phase = 0; phase < BLIP_PHASES; phase++) {
+		float *kernel = blip_kernel[phase];
+		float sum = 0.0f;
+
+		for (int k = 0; k < BLIP_TAPS; k++) {
+			double x = k - (BLIP_TAPS / 2 - 1) - (double) phase / BLIP_PHASES;
+			double y = BLIP_CUTOFF * x;
+			double sinc = y == 0.0 ? 1.0 : sin(MA_PI_D * y) / (MA_PI_D * y);
+			double window = 0.42 + 0.5 * cos(MA_PI_D * x / (BLIP_TAPS / 2)) + 0.08 * cos(2 * MA_PI_D * x / (BLIP_TAPS / 2));
+			kernel[k] = (float) (sinc * window);
+			sum += kernel[k];
+		}
+
+		// every step has to integrate to exactly its height
+		for (int k = 0; k < BLIP_TAPS; k++) {
+			kernel[k] /= sum;
+		}
+	}
+}
+
+// runs on the audio thread, it only ever touches the ring
+static void audio_callback(ma_device *device, void *output, const void *input, ma_uint32 frame_count) {
+	int16_t *out = output;
+
+	while (frame_count) {
+		ma_uint32 frames = frame_count;
+		void *buffer;
+		ma_pcm_rb_acquire_read(&audio_ring, &frames, &buffer);
+		if (frames == 0) break;
+
+		memcpy(out, buffer, frames * 2 * sizeof(int16_t));
+		ma_pcm_rb_commit_read(&audio_ring, frames);
+		out += frames * 2;
+		frame_count -= frames;
+	}
+
+	// underrun, play silence until the emulation catches up
+	memset(out, 0, frame_count * 2 * sizeof(int16_t));
+}
+
+static void noise_init(void) {
+	uint16_t lfsr = 1;
+	for (int n = 0; n < NOISE_LENGTH; n++) {
+		noise_ones[n + 1] = noise_ones[n] + (lfsr & 1);
+		uint16_t bit = (lfsr ^ (lfsr >> 1)) & 1;
+		lfsr = (lfsr >> 1) | (bit << 14);
+	}
+}
+
+static void audio_init(bool open_device) {
+	blip_init();
+	noise_init();
+	ma_pcm_rb_init(ma_format_s16, 2, AUDIO_RING_FRAMES, NULL, NULL, &audio_ring);
+	if (!open_device) return;
+
+	ma_device_config config = ma_device_config_init(ma_device_type_playback);
+	config.playback.format = ma_format_s16;
+	config.playback.channels = 2;
+	config.sampleRate = SAMPLE_RATE;
+	config.dataCallback = audio_callback;
+
+	if (ma_device_init(NULL, &config, &audio_device) != MA_SUCCESS || ma_device_start(&audio_device) != MA_SUCCESS) {
+		printf("Error opening audio device\n");
+		return;
+	}
+	audio_open = true;
+}
+
+// CPU_CLOCK / FRAME_RATE doesn't divide evenly, the remainder is spread over the frames
+// so every second runs exactly CPU_CLOCK cycles
+static uint32_t frame_length(void) {
+	uint64_t frame = frame_number;
+	return (uint32_t) ((frame + 1) * CPU_CLOCK / FRAME_RATE - frame * CPU_CLOCK / FRAME_RATE);
+}
+
+// runs one frame worth of cycles, stopping at every device event on the way
+static void run_frame(uint32_t cycles) {
+	frame_start += frame_cycles;
+	frame_cycles = cycles;
+	uint64_t end = frame_start + cycles;
+
+	latched_lines = 0;
+	latch_input();
+	arm_line_irq(frame_start);
+	update_devices(cycles_now());
+
+	while (cycles_now() < end) {
+		run_until(next_event < end ? next_event : end);
+
+		update_devices(cycles_now());
+		update_irq();
+	}
+
+	// vblank
+	latch_lines(HEIGHT);
+	display_page = ram[REG_FLIP] & 0x01;
+	frame_number++;
+	video_publish();
+
+	audio_render(cycles_now());
+
+	console_flush();
+}
+
+// PERFORMANCE COUNTERS
+static void latch_counter(uint16_t address, uint64_t value, int size) {
+	for (int i = 0; i < size; i++) {
+		ram[address + i] = (value >> (i * 8)) & 0xFF;
+	}
+}
+
+static void profile_mark(uint8_t id) {
+	uint64_t now = cycles_now();
+	console_flush(); // keep the order of guest output and marks
+	fprintf(console_stream, "PROFILE %02X: cycle %" PRIu64 ", frame %" PRIu32 ", +%" PRIu64 " cycles since last mark\n",
+		id, now, frame_number, now - last_mark_cycle);
+	last_mark_cycle = now;
+}
+
+// cycles for the next frame, nudged so the ring stays near its target fill
+static uint32_t audio_frame_cycles(void) {
+	double target = audio_device.playback.internalPeriodSizeInFrames * AUDIO_TARGET_PERIODS;
+	double fill = ma_pcm_rb_available_read(&audio_ring);
+
+	double adjust = (target - fill) / target * RATE_ADJUST_MAX;
+	if (adjust > RATE_ADJUST_MAX) adjust = RATE_ADJUST_MAX;
+	if (adjust < -RATE_ADJUST_MAX) adjust = -RATE_ADJUST_MAX;
+
+	return (uint32_t) (frame_length() * (1.0 + adjust));
+}
+
+// INPUT
+static bool input_push(uint8_t type, uint8_t index, uint64_t value) {
+	size_t size = sizeof(InputEvent);
+	void *buffer;
+	if (ma_rb_available_write(&input_queue) < size) return false; // the emulation is stalled
+
+	ma_rb_acquire_write(&input_queue, &size, &buffer);
+	*(InputEvent *) buffer = (InputEvent) { type, index, value };
+	ma_rb_commit_write(&input_queue, size);
+	return true;
+}
+
+static void debug_step(void) {
+	printf("PRE-STATE\n");
+
+	printf("PC: %04X\n", pc);
+	printf("SP: %02X\n", sp);
+	printf("A: %02X\n", a);
+	printf("X: %02X\n", x);
+	printf("Y: %02X\n", y);
+	printf("Status: %02X\n", status);
+	printf("\n");
+
+	step6502();
+
+	printf("PC: %04X\n", pc);
+	printf("SP: %02X\n", sp);
+	printf("A: %02X\n", a);
+	printf("X: %02X\n", x);
+	printf("Y: %02X\n", y);
+	printf("Status: %02X\n", status);
+	printf("\n");
+
+	printf("STACK\n");
+	for (int i = 0x100; i < 0x1FF; i++) {
+		printf("%02X ", ram[i]);
+	}
+	printf("\n");
+}
+
+static void latch_input(void) {
+	while (ma_rb_available_read(&input_queue) >= sizeof(InputEvent)) {
+		size_t size = sizeof(InputEvent);
+		void *buffer;
+		ma_rb_acquire_read(&input_queue, &size, &buffer);
+		InputEvent event = *(InputEvent *) buffer;
+		ma_rb_commit_read(&input_queue, size);
+
+		if (event.type == INPUT_KEY) {
+			uint64_t bit = (uint64_t) 1 << event.index;
+			host_keys = event.value ? host_keys | bit : host_keys & ~bit;
+		} else if (event.type == INPUT_STEP) {
+			debug_step();
+		}
+	}
+
+	latch_counter(REG_KEYS, host_keys, 8);
+	for (int i = 0; i < PAD_COUNT; i++) {
+		latch_counter(REG_PAD0 + i * 8, ma_atomic_load_64(&host_pads[i]), 8);
+	}
+}
+
+static void poll_gamepads(void) {
+	for (int i = 0; i < PAD_COUNT; i++) {
+		GLFWgamepadstate state;
+		uint64_t pad = 0;
+
+		if (glfwJoystickIsGamepad(GLFW_JOYSTICK_1 + i) && glfwGetGamepadState(GLFW_JOYSTICK_1 + i, &state)) {
+			pad = PAD_CONNECTED;
+			for (int button = 0; button <= GLFW_GAMEPAD_BUTTON_LAST; button++) {
+				if (state.buttons[button]) pad |= 1 << button;
+			}
+			for (int axis = 0; axis <= GLFW_GAMEPAD_AXIS_LAST; axis++) {
+				int8_t value = (int8_t) lroundf(state.axes[axis] * 127);
+				pad |= (uint64_t) (uint8_t) value << ((PAD_AXES + axis) * 8);
+			}
+		}
+
+		ma_atomic_store_64(&host_pads[i], pad);
+	}
+}
+
+// retries releases that found the queue full, a dropped one would leave the key held
+static void flush_releases(void) {
+	for (int i = 0; i < 64 && pending_releases; i++) {
+		uint64_t bit = (uint64_t) 1 << i;
+		if ((pending_releases & bit) && input_push(INPUT_KEY, i, 0)) pending_releases &= ~bit;
+	}
+}
+
+// EMULATION THREAD
+// runs fixed frames on its own clock, so a slow swap or a window drag doesn't stall the cpu
+static ma_thread_result MA_THREADCALL emulation_main(void *data) {
+	ma_timer timer;
+	ma_timer_init(&timer);
+	double next_frame = 0.0;
+
+	while (ma_atomic_load_32(&emulation_running)) {
+		if (audio_sync && audio_open) {
+			run_frame(audio_frame_cycles());
+		} else {
+			run_frame(frame_length());
+		}
+
+		next_frame += 1.0 / FRAME_RATE;
+		double now = ma_timer_get_time_in_seconds(&timer);
+		if (now - next_frame > FRAME_TIME_MAX) {
+			next_frame = now; // too far behind to catch up
+		} else if (next_frame > now) {
+			ma_sleep((ma_uint32) ((next_frame - now) * 1000.0));
+		}
+	}
+	return (ma_thread_result) 0;
+}
+
+static uint16_t fb_page_base(int page) {
+	return page ? FB_PAGE1 : FB_START;
+}
+
+// where the frame's bitmap is read from, 8bpp is too big to have a second page
+static uint16_t display_base(const VideoFrame *video, int vmode) {
+	return fb_page_base(vmode == VMODE_8BPP ? 0 : video->display_page);
+}
+
+// RASTERIZER
+static uint16_t raster_base(void) {
+	return fb_page_base(ram[REG_DRAW_PAGE] & 0x01);
+}
+
+static void mark_rows_dirty(int first_row, int last_row) {
+	mark_dirty(raster_base() + first_row * (WIDTH / 2), (last_row - first_row + 1) * (WIDTH / 2));
+}
+
+static void plot(int x, int y, uint8_t color) {
+	uint8_t *byte = &ram[raster_base() + y * (WIDTH / 2) + x / 2];
+	if (x & 1) {
+		*byte = (*byte & 0x0F) | (color << 4);
+	} else {
+		*byte = (*byte & 0xF0) | color;
+	}
+}
+
+// fills x0..x1 inclusive, the whole bytes in between go through memset
+static void fill_span(int y, int x0, int x1, uint8_t color) {
+	uint8_t *row = &ram[raster_base() + y * (WIDTH / 2)];
+
+	if (x0 & 1) {
+		plot(x0, y, color);
+		x0++;
+	}
+	if (!(x1 & 1)) {
+		plot(x1, y, color);
+		x1--;
+	}
+	if (x1 > x0) {
+		memset(&row[x0 / 2], color * 0x11, (x1 - x0 + 1) / 2);
+	}
+}
+
+static int raster_line(int x0, int y0, int x1, int y1, uint8_t color) {
+	int dx = abs(x1 - x0);
+	int dy = -abs(y1 - y0);
+	int sx = x0 < x1 ? 1 : -1;
+	int sy = y0 < y1 ? 1 : -1;
+	int err = dx + dy;
+	int pixels = 0;
+
+	int min_y = y0 < y1 ? y0 : y1;
+	int max_y = y0 < y1 ? y1 : y0;
+	if (max_y < 0 || min_y >= HEIGHT) return 0;
+
+	while (true) {
+		if (x0 >= 0 && x0 < WIDTH && y0 >= 0 && y0 < HEIGHT) {
+			plot(x0, y0, color);
+			pixels++;
+		}
+
+		if (x0 == x1 && y0 == y1) break;
+
+		int e2 = 2 * err;
+		if (e2 >= dy) {
+			err += dy;
+			x0 += sx;
+		}
+		if (e2 <= dx) {
+			err += dx;
+			y0 += sy;
+		}
+	}
+
+	mark_rows_dirty(min_y < 0 ? 0 : min_y, max_y >= HEIGHT ? HEIGHT - 1 : max_y);
+	return pixels;
+}
+
+static int raster_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint8_t color) {
+	int t;
+	#define SWAP(a, b) t = a; a = b; b = t
+	if (y1 < y0) { SWAP(x0, x1); SWAP(y0, y1); }
+	if (y2 < y0) { SWAP(x0, x2); SWAP(y0, y2); }
+	if (y2 < y1) { SWAP(x1, x2); SWAP(y1, y2); }
+	#undef SWAP
+
+	if (y0 == y2) return 0;
+
+	// rows whose centers lie within the triangle, clipped to the screen
+	int first_row = (int) ceilf(y0 - 0.5f);
+	int last_row = (int) ceilf(y2 - 0.5f) - 1;
+	if (first_row < 0) first_row = 0;
+	if (last_row >= HEIGHT) last_row = HEIGHT - 1;
+	if (first_row > last_row) return 0;
+
+	int pixels = 0;
+	for (int y = first_row; y <= last_row; y++) {
+		float fy = y + 0.5f;
+
+		float long_x = x0 + (x2 - x0) * (fy - y0) / (y2 - y0);
+		float short_x;
+		if (fy < y1) {
+			short_x = x0 + (x1 - x0) * (fy - y0) / (y1 - y0);
+		} else if (y2 != y1) {
+			short_x = x1 + (x2 - x1) * (fy - y1) / (y2 - y1);
+		} else {
+			short_x = x1;
+		}
 
-bool is_fullscreen = false;
-int prev_x, prev_y, prev_w, prev_h;
-static int get_current_monitor(void);
-static void toggle_fullscreen(void);
+		float left = long_x < short_x ? long_x : short_x;
+		float right = long_x < short_x ? short_x : long_x;
 
-// EMULATION STUFF
-extern uint16_t pc;
-extern uint8_t sp, a, x, y, status;
-void reset6502(void);
-void exec6502(uint32_t tick_count);
-void step6502(void);
-void irq6502(void);
-void nmi6502(void);
+		// left edge inclusive, right edge exclusive
+		int span_start = (int) ceilf(left - 0.5f);
+		int span_end = (int) ceilf(right - 0.5f) - 1;
+		if (span_start < 0) span_start = 0;
+		if (span_end >= WIDTH) span_end = WIDTH - 1;
+		if (span_start > span_end) continue;
 
-uint8_t ram[1 << 16];
+		fill_span(y, span_start, span_end, color);
+		pixels += span_end - span_start + 1;
+	}
+
+	mark_rows_dirty(first_row, last_row);
+	return pixels;
+}
+
+static void raster_command(uint8_t command) {
+	uint8_t *regs = &ram[REG_RASTER];
+	#define COORD(offset) ((int16_t) (regs[offset] | (regs[offset + 1] << 8)))
+	uint8_t color = regs[RASTER_COLOR] & 0x0F;
+	int pixels = 0;
+
+	switch (command) {
+		case RASTER_LINE:
+			pixels = raster_line(COORD(RASTER_X0), COORD(RASTER_Y0), COORD(RASTER_X1), COORD(RASTER_Y1), color);
+			break;
+		case RASTER_TRIANGLE:
+			pixels = raster_triangle(COORD(RASTER_X0), COORD(RASTER_Y0), COORD(RASTER_X1), COORD(RASTER_Y1),
+				COORD(RASTER_X2), COORD(RASTER_Y2), color);
+			break;
+	}
+	#undef COORD
+
+	// the cpu is held off the bus while the rasterizer writes
+	clockticks6502 += pixels * RASTER_CYCLES_PER_PIXEL;
+}
+
+static uint8_t io_read(uint16_t address) {
+	switch (address) {
+		case REG_CYCLES:
+			latch_counter(REG_CYCLES, cycles_now(), 8);
+			break;
+		case REG_INSTRUCTIONS:
+			latch_counter(REG_INSTRUCTIONS, instructions, 4);
+			break;
+		case REG_FRAME:
+			latch_counter(REG_FRAME, frame_number, 4);
+			break;
+		case REG_LINE:
+			return beam_line(cycles_now());
+		case REG_FLIP:
+			return (ram[REG_FLIP] & 0x01) | ((ram[REG_FLIP] & 0x01) != display_page ? 0x80 : 0);
+		case REG_CONSOLE_IN:
+			return console_read();
+		case REG_CONSOLE_STATUS:
+			console_in_start();
+			return ma_rb_available_read(&console_in) ? 0x01 : 0;
+	}
+
+	if (address >= REG_TIMER0 && address < REG_TIMER0 + TIMER_COUNT * 8) {
+		int offset = address - REG_TIMER0;
+		return timer_read(offset / 8, offset % 8);
+	}
 
-uint8_t read6502(uint16_t address) {
 	return ram[address];
 }
 
-void write6502(uint16_t address, uint8_t value) {
+static void io_write(uint16_t address, uint8_t value) {
+	if (address >= REG_TIMER0 && address < REG_TIMER0 + TIMER_COUNT * 8) {
+		int offset = address - REG_TIMER0;
+		if (offset % 8 != TIMER_STATUS) ram[address] = value;
+		timer_write(offset / 8, offset % 8, value);
+		return;
+	}
+
+	// the counters are read only
+	if (address >= REG_CYCLES && address < REG_PROFILE_MARK) return;
+	if (address == REG_LINE || address == REG_CONSOLE_IN || address == REG_CONSOLE_STATUS) return;
+	if (address >= REG_KEYS && address < REG_PAD0 + PAD_COUNT * 8) return;
+
+	if ((address >= REG_SCROLL_X && address < REG_SCROLL_Y + 2)
+		|| (address >= REG_PALETTE && address < REG_PALETTE + PALETTE_SIZE * 3)) {
+		latch_lines(beam_line(cycles_now()) + 1);
+	}
+
+	// everything before this write still plays with the old values
+	if (address >= REG_PSG && address < REG_PAN + AUDIO_VOICES) {
+		audio_render(cycles_now());
+	}
+
 	ram[address] = value;
+
+	if (address >= REG_PSG && address < REG_PSG + PSG_VOICES * 8) {
+		int offset = address - REG_PSG;
+		psg_write(offset / 8, offset % 8, value);
+	}
+
+	if (address >= REG_PCM && address < REG_PCM + PCM_CHANNELS * 8) {
+		int offset = address - REG_PCM;
+		pcm_write(offset / 8, offset % 8, value);
+	}
+
+	switch (address) {
+		case REG_LINE_CMP:
+		case REG_LINE_CTRL:
+			arm_line_irq(cycles_now());
+			update_devices(cycles_now());
+			timeline_break();
+			break;
+		case REG_LINE_STATUS:
+			ram[REG_LINE_STATUS] = 0;
+			irq_line &= ~IRQ_LINE;
+			break;
+		case REG_PROFILE_MARK:
+			profile_mark(value);
+			break;
+		case REG_CONSOLE_OUT:
+			console_write(value);
+			break;
+		case REG_DISK + DISK_CMD:
+			disk_command(value);
+			break;
+		case REG_DISK + DISK_STATUS:
+			ram[REG_DISK + DISK_STATUS] = disk_busy ? DISK_BUSY : 0;
+			irq_line &= ~IRQ_DISK;
+			break;
+		case REG_RASTER + RASTER_CMD:
+			raster_command(value);
+			break;
+		case REG_MAP_CTRL:
+		case REG_BANK0:
+		case REG_BANK0 + 1:
+		case REG_BANK1:
+		case REG_BANK1 + 1:
+			update_mapper();
+			break;
+	}
 }
 
 static void reset(void) {
 	memset(ram, 0, sizeof(ram));
+	memset(block_dirty, true, sizeof(block_dirty));
+
+	for (int i = 0; i < 256; i++) {
+		read_pages[i] = &ram[i << 8];
+		write_pages[i] = &ram[i << 8];
+	}
+	read_pages[IO_PAGE] = NULL;
+	write_pages[IO_PAGE] = NULL;
+
+	memcpy(&ram[REG_PALETTE], default_palette, sizeof(default_palette));
+
+	display_page = 0;
+	line_irq_armed = false;
+	memset(timers, 0, sizeof(timers));
+	irq_line = 0;
+	next_event = UINT64_MAX;
+	hookexternal(NULL);
+
 	reset6502();
-	pc = 0x41C0;
+	pc = PROGRAM_START;
+}
+
+// the whole image stays resident for the banks, its start is copied in as the boot program
+static bool load_rom(const char *path) {
+	FILE *rom = fopen(path, "rb");
+	if (!rom) {
+		fprintf(console_stream, "Error opening %s\n", path);
+		return false;
+	}
+
+	fseek(rom, 0, SEEK_END);
+	long rom_size = ftell(rom);
+	fseek(rom, 0, SEEK_SET);
+
+	// round up so every 8 KB and 16 KB bank number maps to a full bank
+	rom_image_size = (rom_size + 0x3FFF) & ~0x3FFF;
+	if (rom_image_size == 0) rom_image_size = 0x4000;
+	rom_image = calloc(rom_image_size, 1);
+	fread(rom_image, 1, rom_size, rom);
+	fclose(rom);
+
+	// the start of the image is the boot program, the rest is only reachable through banks
+	long boot_size = rom_size < BANK_WINDOW - PROGRAM_START ? rom_size : BANK_WINDOW - PROGRAM_START;
+	memcpy(&ram[PROGRAM_START], rom_image, boot_size);
+	return true;
+}
+
+// checks whether any block the range touches was written after frame since
+static bool range_dirty(const VideoFrame *video, uint32_t since, uint16_t base, int size) {
+	for (int block = base >> DIRTY_SHIFT; block <= (base + size - 1) >> DIRTY_SHIFT; block++) {
+		if (video->block_frame[block] > since) return true;
+	}
+	return false;
+}
+
+// takes the next buffer of the ring once the gpu is done reading it and maps it for writing
+static void upload_begin(void) {
+	upload_index = (upload_index + 1) % UPLOAD_BUFFERS;
+
+	double start = ma_timer_get_time_in_seconds(&upload_timer);
+	GLsync fence = upload_fences[upload_index];
+	if (fence) {
+		while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+		glDeleteSync(fence);
+		upload_fences[upload_index] = NULL;
+	}
+	upload_wait += ma_timer_get_time_in_seconds(&upload_timer) - start;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_buffers[upload_index]);
+	upload_data = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, UPLOAD_BUFFER_SIZE,
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	upload_size = 0;
+	upload_span_count = 0;
+}
+
+// copies texture rows into the mapped buffer, the texture update is issued by upload_end()
+static void upload_span(const void *src, uint32_t size, unsigned int texture, int row, int width, int rows, GLenum format, GLenum type) {
+	if (upload_span_count == UPLOAD_SPANS || upload_size + size > UPLOAD_BUFFER_SIZE) {
+		printf("Upload buffer full, dropping %" PRIu32 " bytes\n", size);
+		return;
+	}
+
+	memcpy(upload_data + upload_size, src, size);
+	upload_spans[upload_span_count++] = (UploadSpan) { texture, row, width, rows, format, type, upload_size };
+	upload_size = (upload_size + size + 3) & ~3;
+	upload_bytes += size;
+}
+
+static void upload_rows(const VideoFrame *video, unsigned int texture, uint16_t base, int pitch, int width, int row, int rows, GLenum format, GLenum type) {
+	upload_span(&video->ram[base + row * pitch], rows * pitch, texture, row, width, rows, format, type);
+}
+
+// uploads the rows of a region written after frame since, coalescing runs of rows,
+// the texture is one byte per texel so its width is the pitch
+static void upload_dirty_rows(const VideoFrame *video, uint32_t since, unsigned int texture, uint16_t base, int pitch, int height, GLenum format, GLenum type) {
+	int row = 0;
+	while (row < height) {
+		if (!range_dirty(video, since, base + row * pitch, pitch)) {
+			row++;
+			continue;
+		}
+
+		int start = row;
+		while (row < height && range_dirty(video, since, base + row * pitch, pitch)) {
+			row++;
+		}
+
+		upload_rows(video, texture, base, pitch, pitch, start, row - start, format, type);
+	}
+}
+
+// sources the queued texture updates from the buffer and fences it until the gpu has read them
+static void upload_end(void) {
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	upload_data = NULL;
+
+	for (int i = 0; i < upload_span_count; i++) {
+		UploadSpan *span = &upload_spans[i];
+		glBindTexture(GL_TEXTURE_2D, span->texture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, span->row, span->width, span->rows, span->format, span->type, (void*) (uintptr_t) span->offset);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (upload_span_count) {
+		upload_fences[upload_index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
 }
 
 // CALLBACKS
 static void draw() {
 	glClear(GL_COLOR_BUFFER_BIT);
 
+	// everything up to uploaded_frame is already in the textures
+	VideoFrame *video = video_acquire();
+	uint32_t since = uploaded_frame;
+
+	int vmode = video->ram[REG_VMODE] < VMODE_COUNT ? video->ram[REG_VMODE] : VMODE_BITMAP;
+	if (vmode != last_vmode) {
+		// the video ram was written under a different layout, upload everything
+		since = 0;
+		uploaded_base = -1;
+		last_vmode = vmode;
+	}
+
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_1D, pal_texture);
+	glBindTexture(GL_TEXTURE_2D, pal_texture);
+
+	glUseProgram(shader_programs[vmode]);
+
+	// copy what changed in video memory, the whole page after a flip, and the line tables
+	// on frames with raster effects
+	upload_begin();
+	double copy_start = ma_timer_get_time_in_seconds(&upload_timer);
+	if (video->line_table_frame > uploaded_frame) {
+		upload_span(video->line_palettes, sizeof(video->line_palettes), pal_texture, 0, PALETTE_SIZE, HEIGHT, GL_RGB, GL_UNSIGNED_BYTE);
+	}
+	if (vmode == VMODE_TILE) {
+		upload_dirty_rows(video, since, pattern_texture, TILE_PATTERNS, PATTERN_TEX_WIDTH, PATTERN_TEX_HEIGHT, GL_RED, GL_UNSIGNED_BYTE);
+		upload_dirty_rows(video, since, map_texture, TILE_MAP, TILE_MAP_WIDTH, TILE_MAP_HEIGHT, GL_RED, GL_UNSIGNED_BYTE);
+		if (since == 0 || video->line_table_frame > since) {
+			upload_span(video->line_table, sizeof(video->line_table), line_texture, 0, 1, HEIGHT, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE);
+		}
+	} else if (vmode == VMODE_TEXT) {
+		if (range_dirty(video, since, TEXT_CELLS, TEXT_COLUMNS * TEXT_ROWS * 2)) {
+			upload_rows(video, cell_texture, TEXT_CELLS, TEXT_COLUMNS * 2, TEXT_COLUMNS, 0, TEXT_ROWS, GL_RG_INTEGER, GL_UNSIGNED_BYTE);
+		}
+	} else {
+		const VideoMode *mode = &video_modes[vmode];
+		uint16_t base = display_base(video, vmode);
+		if (base != uploaded_base) {
+			since = 0;
+			uploaded_base = base;
+		}
+		upload_dirty_rows(video, since, fb_textures[vmode], base, mode->pitch, mode->height, mode->format, mode->type);
+	}
 	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, fb_texture);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH / 2, HEIGHT, GL_RED, GL_UNSIGNED_BYTE, fb);
+	upload_end();
+	upload_time += ma_timer_get_time_in_seconds(&upload_timer) - copy_start;
+
+	if (vmode == VMODE_TILE) {
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, pattern_texture);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, map_texture);
+
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_2D, line_texture);
+	} else if (vmode == VMODE_TEXT) {
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, cell_texture);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, font_texture);
+	} else {
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, fb_textures[vmode]);
+	}
+
+	uploaded_frame = video->frame;
 
-	glUseProgram(shader_program);
 	glBindVertexArray(vao);
 	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 
@@ -150,40 +2244,460 @@ static void size_callback(GLFWwindow *window, int width, int height) {
 }
 
 static void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods) {
+	for (int i = 0; i < 64; i++) {
+		if (key_matrix[i] != key) continue;
+
+		uint64_t bit = (uint64_t) 1 << i;
+		if (action == GLFW_PRESS) {
+			// a release still pending means the emulation already sees the key held
+			if (pending_releases & bit) pending_releases &= ~bit;
+			else input_push(INPUT_KEY, i, 1);
+		} else if (action == GLFW_RELEASE) {
+			if (!input_push(INPUT_KEY, i, 0)) pending_releases |= bit;
+		}
+	}
+
 	if (key == GLFW_KEY_ENTER && (mods & GLFW_MOD_ALT) && action == GLFW_PRESS) {
 		toggle_fullscreen();
 	}
 
-	if (key == GLFW_KEY_SPACE && action == GLFW_PRESS) {
-		printf("PRE-STATE\n");
+	// outside the key matrix so the guest never sees it
+	if (key == GLFW_KEY_F12 && action == GLFW_PRESS) {
+		input_push(INPUT_STEP, 0, 0);
+	}
+}
+
+static unsigned int create_program(unsigned int vertex_shader, int vmode) {
+	const char *mode_sources[VMODE_COUNT] = {
+		[VMODE_BITMAP] = bitmap_source,
+		[VMODE_TILE] = tile_source,
+		[VMODE_HIRES] = hires_source,
+		[VMODE_2BPP] = bitmap_2bpp_source,
+		[VMODE_8BPP] = bitmap_8bpp_source,
+		[VMODE_TEXT] = text_source,
+	};
+	const char *sources[] = { fragment_header, mode_sources[vmode], fragment_main };
+
+	unsigned int fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+	glShaderSource(fragment_shader, 3, sources, NULL);
+	glCompileShader(fragment_shader);
+
+	int success;
+	char info_log[512];
+	glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &success);
+	if (!success) {
+		glGetShaderInfoLog(fragment_shader, 512, NULL, info_log);
+		printf("Error compiling fragment shader\n%s\n", info_log);
+	}
+
+	unsigned int program = glCreateProgram();
+	glAttachShader(program, vertex_shader);
+	glAttachShader(program, fragment_shader);
+	glLinkProgram(program);
+
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	if (!success) {
+		glGetProgramInfoLog(program, 512, NULL, info_log);
+		printf("Error linking shader program\n%s\n", info_log);
+	}
+
+	glDeleteShader(fragment_shader);
+
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "pal_tex"), 0);
+	glUniform2i(glGetUniformLocation(program, "screen_size"), video_modes[vmode].width, video_modes[vmode].height);
+	glUniform1f(glGetUniformLocation(program, "warp"), 0.0f);
+	glUniform1f(glGetUniformLocation(program, "scan"), 0.75f);
+
+	return program;
+}
+
+// CONVERTER
+// the bitmap shader's palette lookup on the cpu, for headless frames and screenshots. every
+// path writes the palette bytes unchanged with alpha 255, which is what the shader draws
+// with warp and scanlines off
+
+typedef struct {
+	uint8_t r[16], g[16], b[16]; // one channel per table for the shuffles
+	uint8_t rgba[16][4];
+} ConvertPalette;
+
+static void convert_palette(ConvertPalette *table, const uint8_t *palette) {
+	for (int i = 0; i < 16; i++) {
+		table->r[i] = table->rgba[i][0] = palette[i * 3];
+		table->g[i] = table->rgba[i][1] = palette[i * 3 + 1];
+		table->b[i] = table->rgba[i][2] = palette[i * 3 + 2];
+		table->rgba[i][3] = 0xFF;
+	}
+}
+
+// low nibble is the left pixel, out gets 8 bytes for every source byte
+static void convert_row_scalar(uint8_t *out, const uint8_t *src, int bytes, const ConvertPalette *table) {
+	for (int i = 0; i < bytes; i++) {
+		memcpy(&out[i * 8], table->rgba[src[i] & 0x0F], 4);
+		memcpy(&out[i * 8 + 4], table->rgba[src[i] >> 4], 4);
+	}
+}
+
+#ifdef HAVE_X86
+// 16 source bytes at a time, the palette channels are looked up with pshufb
+TARGET("ssse3") static void convert_row_ssse3(uint8_t *out, const uint8_t *src, int bytes, const ConvertPalette *table) {
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	const __m128i alpha = _mm_set1_epi8((char) 0xFF);
+	const __m128i r = _mm_loadu_si128((const __m128i *) table->r);
+	const __m128i g = _mm_loadu_si128((const __m128i *) table->g);
+	const __m128i b = _mm_loadu_si128((const __m128i *) table->b);
+
+	if (bytes < 16) {
+		convert_row_scalar(out, src, bytes, table);
+		return;
+	}
+
+	// a ragged end is done by one last block overlapping the previous one
+	for (int i = 0; i < bytes; i += 16) {
+		if (i + 16 > bytes) i = bytes - 16;
+		__m128i packed = _mm_loadu_si128((const __m128i *) &src[i]);
+		__m128i low = _mm_and_si128(packed, mask);
+		__m128i high = _mm_and_si128(_mm_srli_epi16(packed, 4), mask);
+
+		for (int half = 0; half < 2; half++) {
+			__m128i index = half ? _mm_unpackhi_epi8(low, high) : _mm_unpacklo_epi8(low, high);
+			__m128i red = _mm_shuffle_epi8(r, index);
+			__m128i green = _mm_shuffle_epi8(g, index);
+			__m128i blue = _mm_shuffle_epi8(b, index);
+			__m128i rg = _mm_unpacklo_epi8(red, green);
+			__m128i ba = _mm_unpacklo_epi8(blue, alpha);
+			__m128i rg_high = _mm_unpackhi_epi8(red, green);
+			__m128i ba_high = _mm_unpackhi_epi8(blue, alpha);
+
+			__m128i *dst = (__m128i *) &out[(i + half * 8) * 8];
+			_mm_storeu_si128(dst, _mm_unpacklo_epi16(rg, ba));
+			_mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(rg, ba));
+			_mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(rg_high, ba_high));
+			_mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(rg_high, ba_high));
+		}
+	}
+}
+
+// 16 source bytes at a time, the low lane holds pixels 0-15 and the high lane 16-31,
+// the per lane unpacks are put back in order by the final permutes
+TARGET("avx2") static void convert_row_avx2(uint8_t *out, const uint8_t *src, int bytes, const ConvertPalette *table) {
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	const __m256i alpha = _mm256_set1_epi8((char) 0xFF);
+	const __m256i r = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) table->r));
+	const __m256i g = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) table->g));
+	const __m256i b = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) table->b));
+
+	if (bytes < 16) {
+		convert_row_scalar(out, src, bytes, table);
+		return;
+	}
+
+	// a ragged end is done by one last block overlapping the previous one
+	for (int i = 0; i < bytes; i += 16) {
+		if (i + 16 > bytes) i = bytes - 16;
+		__m128i packed = _mm_loadu_si128((const __m128i *) &src[i]);
+		__m128i low = _mm_and_si128(packed, mask);
+		__m128i high = _mm_and_si128(_mm_srli_epi16(packed, 4), mask);
+		__m256i index = _mm256_set_m128i(_mm_unpackhi_epi8(low, high), _mm_unpacklo_epi8(low, high));
+
+		__m256i red = _mm256_shuffle_epi8(r, index);
+		__m256i green = _mm256_shuffle_epi8(g, index);
+		__m256i blue = _mm256_shuffle_epi8(b, index);
+		__m256i rg = _mm256_unpacklo_epi8(red, green);
+		__m256i ba = _mm256_unpacklo_epi8(blue, alpha);
+		__m256i rg_high = _mm256_unpackhi_epi8(red, green);
+		__m256i ba_high = _mm256_unpackhi_epi8(blue, alpha);
+
+		__m256i q0 = _mm256_unpacklo_epi16(rg, ba); // pixels 0-3, 16-19
+		__m256i q1 = _mm256_unpackhi_epi16(rg, ba); // 4-7, 20-23
+		__m256i q2 = _mm256_unpacklo_epi16(rg_high, ba_high); // 8-11, 24-27
+		__m256i q3 = _mm256_unpackhi_epi16(rg_high, ba_high); // 12-15, 28-31
+
+		__m256i *dst = (__m256i *) &out[i * 8];
+		_mm256_storeu_si256(dst, _mm256_permute2x128_si256(q0, q1, 0x20));
+		_mm256_storeu_si256(dst + 1, _mm256_permute2x128_si256(q2, q3, 0x20));
+		_mm256_storeu_si256(dst + 2, _mm256_permute2x128_si256(q0, q1, 0x31));
+		_mm256_storeu_si256(dst + 3, _mm256_permute2x128_si256(q2, q3, 0x31));
+	}
+}
+#endif
+
+typedef void (*ConvertRow)(uint8_t *out, const uint8_t *src, int bytes, const ConvertPalette *table);
+
+typedef struct {
+	const char *name;
+	ConvertRow row;
+} ConvertPath;
+
+enum { CONVERT_SCALAR, CONVERT_SSSE3, CONVERT_AVX2, CONVERT_PATHS };
+
+const ConvertPath convert_paths[CONVERT_PATHS] = {
+	[CONVERT_SCALAR] = { "scalar", convert_row_scalar },
+#ifdef HAVE_X86
+	[CONVERT_SSSE3] = { "SSSE3", convert_row_ssse3 },
+	[CONVERT_AVX2] = { "AVX2", convert_row_avx2 },
+#endif
+};
+
+// the best path this cpu runs, checked once
+static int convert_best_path(void) {
+	static int best = -1;
+	if (best >= 0) return best;
+
+	best = CONVERT_SCALAR;
+#ifdef HAVE_X86
+	if (cpu_features() & CPU_SSSE3) best = CONVERT_SSSE3;
+	if (cpu_features() & CPU_AVX2) best = CONVERT_AVX2;
+#endif
+	return best;
+}
+
+// a 4bpp frame to RGBA32 with the palette latched for each line, every pixel repeated scale
+// times in both directions, out holds WIDTH * scale * HEIGHT * scale pixels, top row first
+static void convert_frame(uint8_t *out, const uint8_t *fb, const uint8_t (*palettes)[PALETTE_SIZE * 3], int scale) {
+	ConvertRow convert_row = convert_paths[convert_best_path()].row;
+	ConvertPalette table;
+	convert_palette(&table, palettes[0]);
+
+	bool one_palette = true;
+	for (int y = 1; y < HEIGHT && one_palette; y++) {
+		one_palette = memcmp(palettes[y], palettes[0], PALETTE_SIZE * 3) == 0;
+	}
+
+	// unscaled rows follow each other in both buffers, so the frame is one long row
+	if (scale == 1 && one_palette) {
+		convert_row(out, fb, WIDTH / 2 * HEIGHT, &table);
+		return;
+	}
+
+	int row_size = WIDTH * scale * 4;
+	for (int y = 0; y < HEIGHT; y++) {
+		if (y > 0 && memcmp(palettes[y], palettes[y - 1], PALETTE_SIZE * 3) != 0) {
+			convert_palette(&table, palettes[y]);
+		}
+
+		uint8_t *row = &out[y * scale * row_size];
+		convert_row(row, &fb[y * (WIDTH / 2)], WIDTH / 2, &table);
+
+		// widen in place from the right so no pixel is overwritten before it's copied
+		for (int x = WIDTH - 1; x >= 0 && scale > 1; x--) {
+			for (int i = scale - 1; i >= 0; i--) {
+				memcpy(&row[(x * scale + i) * 4], &row[x * 4], 4);
+			}
+		}
+		for (int i = 1; i < scale; i++) {
+			memcpy(&row[i * row_size], row, row_size);
+		}
+	}
+}
+
+static void bench_convert(void) {
+	static uint8_t fb[WIDTH / 2 * HEIGHT];
+	static uint8_t reference[WIDTH * HEIGHT * 4];
+	static uint8_t out[WIDTH * HEIGHT * 4];
+
+	uint32_t seed = 1;
+	for (int i = 0; i < (int) sizeof(fb); i++) {
+		seed = seed * 1664525 + 1013904223;
+		fb[i] = seed >> 24;
+	}
+
+	ConvertPalette table;
+	convert_palette(&table, default_palette);
+	convert_row_scalar(reference, fb, sizeof(fb), &table);
+
+	// every path this cpu can run, each timed on whole frames and checked against scalar
+	const int iterations = 10000;
+	for (int path = 0; path <= convert_best_path(); path++) {
+		ConvertRow convert_row = convert_paths[path].row;
+		convert_row(out, fb, sizeof(fb), &table);
+		bool exact = memcmp(reference, out, sizeof(out)) == 0;
+
+		ma_timer timer;
+		ma_timer_init(&timer);
+		double start = ma_timer_get_time_in_seconds(&timer);
+		for (int i = 0; i < iterations; i++) {
+			convert_row(out, fb, sizeof(fb), &table);
+		}
+		double elapsed = ma_timer_get_time_in_seconds(&timer) - start;
+
+		printf("%s converter: %.2f us/frame, %s the scalar output\n", convert_paths[path].name,
+			elapsed * 1e6 / iterations, exact ? "matches" : "differs from");
+	}
+	printf("frames use the %s converter\n", convert_paths[convert_best_path()].name);
+}
+
+// OFFLINE
+static void put_le(uint8_t *out, uint32_t value, int size) {
+	for (int i = 0; i < size; i++) {
+		out[i] = (value >> (i * 8)) & 0xFF;
+	}
+}
+
+static void wav_header(uint8_t *header, uint32_t frames) {
+	uint32_t data_size = frames * 2 * sizeof(int16_t);
+	memcpy(header, "RIFF", 4);
+	put_le(header + 4, 36 + data_size, 4);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	put_le(header + 16, 16, 4);
+	put_le(header + 20, 1, 2); // integer pcm
+	put_le(header + 22, 2, 2);
+	put_le(header + 24, SAMPLE_RATE, 4);
+	put_le(header + 28, SAMPLE_RATE * 2 * sizeof(int16_t), 4);
+	put_le(header + 32, 2 * sizeof(int16_t), 2);
+	put_le(header + 34, 16, 2);
+	memcpy(header + 36, "data", 4);
+	put_le(header + 40, data_size, 4);
+}
+
+static uint32_t audio_drain(FILE *out) {
+	uint32_t total = 0;
+	while (true) {
+		ma_uint32 frames = AUDIO_RING_FRAMES;
+		void *buffer;
+		ma_pcm_rb_acquire_read(&audio_ring, &frames, &buffer);
+		if (frames == 0) return total;
+
+		if (out) fwrite(buffer, 2 * sizeof(int16_t), frames, out);
+		ma_pcm_rb_commit_read(&audio_ring, frames);
+		total += frames;
+	}
+}
 
-		printf("PC: %04X\n", pc);
-		printf("SP: %02X\n", sp);
-		printf("A: %02X\n", a);
-		printf("X: %02X\n", x);
-		printf("Y: %02X\n", y);
-		printf("Status: %02X\n", status);
-		printf("\n");
+// one record per frame, an 8 byte header with the video mode and the data size as little
+// endian uint32, then the shown page of a bitmap mode as it sits in memory, pitch * height
+// bytes and none for tile and text modes. with a scale the data is always the 4bpp bitmap
+// mode converted to RGBA32, zero filled when another mode is shown
+static void write_frame(FILE *out, const VideoFrame *video, int scale) {
+	static uint8_t *rgba;
+	uint8_t header[8];
+
+	int vmode = video->ram[REG_VMODE] < VMODE_COUNT ? video->ram[REG_VMODE] : VMODE_BITMAP;
+	const VideoMode *mode = &video_modes[vmode];
+	const uint8_t *data = &video->ram[display_base(video, vmode)];
+	size_t size = mode->pitch * mode->height; // zero for tile and text modes
+
+	if (scale != 0) {
+		size = (size_t) WIDTH * HEIGHT * scale * scale * 4;
+		if (!rgba) rgba = malloc(size);
+		if (vmode == VMODE_BITMAP) convert_frame(rgba, data, video->line_palettes, scale);
+		else memset(rgba, 0, size);
+		data = rgba;
+	}
 
-		step6502();
+	put_le(header, vmode, 4);
+	put_le(header + 4, (uint32_t) size, 4);
+	fwrite(header, 1, sizeof(header), out);
+	fwrite(data, 1, size, out);
+}
 
-		printf("PC: %04X\n", pc);
-		printf("SP: %02X\n", sp);
-		printf("A: %02X\n", a);
-		printf("X: %02X\n", x);
-		printf("Y: %02X\n", y);
-		printf("Status: %02X\n", status);
-		printf("\n");
+// runs the core as fast as it goes, with no window and no audio device, timing only comes
+// from the cycle count so the output is the same on every run. audio goes to a wav file or
+// raw to stdout, frames are taken from the video buffers like the renderer does
+static int run_headless(const char *wav_path, bool raw_audio, const char *frames_path, int rgba_scale, double seconds) {
+	FILE *out = NULL;
+	FILE *frames_out = NULL;
+	uint8_t header[44];
+
+	if (wav_path) {
+		out = fopen(wav_path, "wb");
+		if (!out) {
+			fprintf(console_stream, "Error opening %s\n", wav_path);
+			return -1;
+		}
+		wav_header(header, 0);
+		fwrite(header, 1, sizeof(header), out);
+	} else if (raw_audio) {
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		out = stdout;
+		console_stream = stderr;
+	}
 
-		printf("STACK\n");
-		for (int i = 0x100; i < 0x1FF; i++) {
-			printf("%02X ", ram[i]);
+	if (frames_path) {
+		frames_out = fopen(frames_path, "wb");
+		if (!frames_out) {
+			fprintf(console_stream, "Error opening %s\n", frames_path);
+			return -1;
 		}
-		printf("\n");
 	}
+
+	reset();
+	if (!load_rom("rom.bin")) {
+		return -1;
+	}
+	disk_open("disk.img");
+	audio_init(false);
+
+	uint32_t frames = 0;
+	uint64_t frame_total = (uint64_t) (seconds * FRAME_RATE);
+	for (uint64_t i = 0; i < frame_total; i++) {
+		run_frame(frame_length());
+		frames += audio_drain(out); // without an output the samples are only dropped
+		if (frames_out) write_frame(frames_out, video_acquire(), rgba_scale);
+	}
+	console_flush();
+
+	if (wav_path) {
+		wav_header(header, frames);
+		fseek(out, 0, SEEK_SET);
+		fwrite(header, 1, sizeof(header), out);
+		fclose(out);
+	} else if (out) {
+		fflush(out);
+	}
+	if (frames_out) fclose(frames_out);
+
+	ma_pcm_rb_uninit(&audio_ring);
+	free(rom_image);
+	return 0;
 }
 
-int main() {
+int main(int argc, char **argv) {
+	const char *wav_path = NULL;
+	const char *frames_path = NULL;
+	bool raw_audio = false;
+	bool headless = false;
+	int rgba_scale = 0;
+	double seconds = 10.0;
+	console_stream = stdout;
+	ma_rb_init(INPUT_QUEUE_SIZE, NULL, NULL, &input_queue);
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--audio-sync") == 0) {
+			audio_sync = true;
+		} else if (strcmp(argv[i], "--bench-mixer") == 0) {
+			bench_mixer();
+			return 0;
+		} else if (strcmp(argv[i], "--wav") == 0 && i + 1 < argc) {
+			wav_path = argv[++i];
+		} else if (strcmp(argv[i], "--stats") == 0) {
+			show_stats = true;
+		} else if (strcmp(argv[i], "--raw") == 0) {
+			raw_audio = true;
+		} else if (strcmp(argv[i], "--headless") == 0) {
+			headless = true;
+		} else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+			frames_path = argv[++i];
+		} else if (strcmp(argv[i], "--rgba") == 0 && i + 1 < argc) {
+			rgba_scale = atoi(argv[++i]);
+			if (rgba_scale < 1) rgba_scale = 1;
+		} else if (strcmp(argv[i], "--bench-convert") == 0) {
+			bench_convert();
+			return 0;
+		} else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+			seconds = atof(argv[++i]);
+		} else {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+		}
+	}
+
+	if (headless || wav_path || raw_audio || frames_path) {
+		return run_headless(wav_path, raw_audio, frames_path, rgba_scale, seconds);
+	}
+
 	// SETUP
 	if (!glfwInit()) {
 		return -1;
@@ -220,16 +2734,6 @@ int main() {
 		return -1;
 	}
 
-	#define HEX(hex) ((hex >> 16) & 0xFF), ((hex >> 8) & 0xFF), (hex & 0xFF), 255
-
-	// Lost Century palette lospec
-	uint8_t pal[PALETTE_SIZE * 4] = {
-		HEX(0x1a1c2c), HEX(0x5d275d), HEX(0xb13e53), HEX(0xef7d57),
-		HEX(0xffcd75), HEX(0xa7f070), HEX(0x38b764), HEX(0x257179),
-		HEX(0x29366f), HEX(0x3b5dc9), HEX(0x41a6f6), HEX(0x73eff7),
-		HEX(0xf4f4f4), HEX(0x94b0c2), HEX(0x566c86), HEX(0x333c57)
-	};
-
 	// SHADERS
 	unsigned int vertex_shader = glCreateShader(GL_VERTEX_SHADER);
 	glShaderSource(vertex_shader, 1, &vertex_source, NULL);
@@ -243,36 +2747,19 @@ int main() {
 		printf("Error compiling vertex shader\n%s\n", info_log);
 	}
 
-	unsigned int fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-	glShaderSource(fragment_shader, 1, &fragment_source, NULL);
-	glCompileShader(fragment_shader);
-
-	glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &success);
-	if (!success) {
-		glGetShaderInfoLog(fragment_shader, 512, NULL, info_log);
-		printf("Error compiling fragment shader\n%s\n", info_log);
-	}
-
-	shader_program = glCreateProgram();
-	glAttachShader(shader_program, vertex_shader);
-	glAttachShader(shader_program, fragment_shader);
-	glLinkProgram(shader_program);
-
-	glGetProgramiv(shader_program, GL_LINK_STATUS, &success);
-	if (!success) {
-		glGetProgramInfoLog(shader_program, 512, NULL, info_log);
-		printf("Error linking shader program\n%s\n", info_log);
+	for (int i = 0; i < VMODE_COUNT; i++) {
+		shader_programs[i] = create_program(vertex_shader, i);
 	}
 
 	glDeleteShader(vertex_shader);
-	glDeleteShader(fragment_shader);
 
 	// MORE GL STUFF
+	// texture row 0 is the first line in memory and the first line the beam draws, so it goes at the top
 	float vertices[] = {
-		 1.0f,  1.0f, 0.0f,    1.0f, 1.0f,
-		 1.0f, -1.0f, 0.0f,    1.0f, 0.0f,
-		-1.0f, -1.0f, 0.0f,    0.0f, 0.0f,
-		-1.0f,  1.0f, 0.0f,    0.0f, 1.0f
+		 1.0f,  1.0f, 0.0f,    1.0f, 0.0f,
+		 1.0f, -1.0f, 0.0f,    1.0f, 1.0f,
+		-1.0f, -1.0f, 0.0f,    0.0f, 1.0f,
+		-1.0f,  1.0f, 0.0f,    0.0f, 0.0f
 	};
 
 	unsigned int indices[] = {
@@ -303,54 +2790,109 @@ int main() {
 
 	// TEXTURES
 
-	// palette texture (1D)
+	// palette texture, one row per line
 	glGenTextures(1, &pal_texture);
-	glBindTexture(GL_TEXTURE_1D, pal_texture);
-	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA, PALETTE_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, pal);
-
-	// framebuffer texture (2D)
-	glGenTextures(1, &fb_texture);
-	glBindTexture(GL_TEXTURE_2D, fb_texture);
+	glBindTexture(GL_TEXTURE_2D, pal_texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, PALETTE_SIZE, HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+
+	// framebuffer textures (2D), one per bitmap mode in that mode's format
+	for (int i = 0; i < VMODE_COUNT; i++) {
+		const VideoMode *mode = &video_modes[i];
+		if (!mode->pitch) continue;
+
+		glGenTextures(1, &fb_textures[i]);
+		glBindTexture(GL_TEXTURE_2D, fb_textures[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, mode->internal_format, mode->pitch, mode->height, 0, mode->format, mode->type, NULL);
+
+		glUseProgram(shader_programs[i]);
+		glUniform1i(glGetUniformLocation(shader_programs[i], "fb_tex"), 1);
+	}
+
+	// pattern table texture (2D), 128 bytes per row
+	glGenTextures(1, &pattern_texture);
+	glBindTexture(GL_TEXTURE_2D, pattern_texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, PATTERN_TEX_WIDTH, PATTERN_TEX_HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+
+	// tilemap texture (2D)
+	glGenTextures(1, &map_texture);
+	glBindTexture(GL_TEXTURE_2D, map_texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, TILE_MAP_WIDTH, TILE_MAP_HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+
+	// per line register texture (2D), one RGBA texel per line
+	glGenTextures(1, &line_texture);
+	glBindTexture(GL_TEXTURE_2D, line_texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8UI, 1, HEIGHT, 0, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, NULL);
+
+	// text cell texture (2D), code and attribute per texel
+	glGenTextures(1, &cell_texture);
+	glBindTexture(GL_TEXTURE_2D, cell_texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8UI, TEXT_COLUMNS, TEXT_ROWS, 0, GL_RG_INTEGER, GL_UNSIGNED_BYTE, NULL);
+
+	// font texture (2D), 5 columns for each of the 256 codes, uploaded once
+	uint8_t font[256][5] = { 0 };
+	memcpy(font[32], font_rom, sizeof(font_rom));
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glGenTextures(1, &font_texture);
+	glBindTexture(GL_TEXTURE_2D, font_texture);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, WIDTH / 2, HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, fb);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, 5, 256, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, font);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	// pixel buffers the video memory is uploaded through
+	glGenBuffers(UPLOAD_BUFFERS, upload_buffers);
+	for (int i = 0; i < UPLOAD_BUFFERS; i++) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_buffers[i]);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, UPLOAD_BUFFER_SIZE, NULL, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	ma_timer_init(&upload_timer);
 
 	// assign uniforms
-	glUseProgram(shader_program);
-	glUniform1i(glGetUniformLocation(shader_program, "pal_tex"), 0);
-	glUniform1i(glGetUniformLocation(shader_program, "fb_tex"), 1);
-	glUniform1i(glGetUniformLocation(shader_program, "fb_width"), WIDTH / 2);
-	glUniform1f(glGetUniformLocation(shader_program, "warp"), 0.0f);
-	glUniform1f(glGetUniformLocation(shader_program, "scan"), 0.75f);
+	glUseProgram(shader_programs[VMODE_TEXT]);
+	glUniform1i(glGetUniformLocation(shader_programs[VMODE_TEXT], "cell_tex"), 1);
+	glUniform1i(glGetUniformLocation(shader_programs[VMODE_TEXT], "font_tex"), 2);
+
+	glUseProgram(shader_programs[VMODE_TILE]);
+	glUniform1i(glGetUniformLocation(shader_programs[VMODE_TILE], "pattern_tex"), 1);
+	glUniform1i(glGetUniformLocation(shader_programs[VMODE_TILE], "map_tex"), 2);
+	glUniform1i(glGetUniformLocation(shader_programs[VMODE_TILE], "line_tex"), 3);
 
 	// emulation stuff
 	reset();
 
-	FILE *rom = fopen("rom.bin", "rb");
-	if (!rom) {
-		printf("Error opening rom.bin\n");
+	if (!load_rom("rom.bin")) {
 		return -1;
 	}
 
-	fseek(rom, 0, SEEK_END);
-	long rom_size = ftell(rom);
-	fseek(rom, 0, SEEK_SET);
+	// optional, bigger programs stream their data from it
+	disk_open("disk.img");
 
-	uint8_t *program = malloc(rom_size);
-	fread(program, 1, rom_size, rom);
-	fclose(rom);
+	audio_init(true);
 
-	for (int i = 0; i < rom_size; i++) {
-		ram[0x41C0 + i] = program[i];
+	emulation_running = true;
+	if (ma_thread_create(&emulation_thread, ma_thread_priority_normal, 0, emulation_main, NULL, NULL) != MA_SUCCESS) {
+		printf("Error starting emulation thread\n");
+		return -1;
 	}
 
-	free(program);
-
-	// MAIN LOOP
+	// MAIN LOOP, only renders and polls input, the emulation thread runs the cpu
 	double last_time = glfwGetTime();
 	int frame_count = 0;
+	uint32_t stats_frame = 0; // uploaded_frame at the last stats line
 
 	int time_counter = 0;
 
@@ -364,35 +2906,41 @@ int main() {
 		static double fps_time_accum = 0.0;
 		fps_time_accum += delta_time;
 		if (fps_time_accum >= 1.0) {
-			// printf("FPS: %d\n", frame_count);
+			if (show_stats) {
+				printf("FPS: %d, emulated %" PRIu32 ", uploaded %" PRIu32 " bytes/frame, upload %.3f ms/frame, gpu wait %.3f ms/frame\n",
+					frame_count, uploaded_frame - stats_frame, upload_bytes / frame_count, upload_time * 1000.0 / frame_count, upload_wait * 1000.0 / frame_count);
+			}
+			stats_frame = uploaded_frame;
+			upload_bytes = 0;
+			upload_time = 0.0;
+			upload_wait = 0.0;
 			frame_count = 0;
 			fps_time_accum = 0.0;
 		}
 
-		for (int i = 0; i < WIDTH * HEIGHT / 2; i++) {
-			fb[i] = read6502(0x200 + i);
-		}
-
-		// run 6502 at 10 MHz
-		int current_monitor = get_current_monitor();
-		int monitor_count;
-		GLFWmonitor **monitors = glfwGetMonitors(&monitor_count);
-		GLFWmonitor *monitor = monitors[current_monitor];
-		const GLFWvidmode *mode = glfwGetVideoMode(monitor);
-		int refresh_rate = mode->refreshRate;
-
-		exec6502(10000000 / refresh_rate);
-
 		draw();
 
 		glfwPollEvents();
+		poll_gamepads();
+		flush_releases();
 	}
 
 	// CLEANUP
+	ma_atomic_store_32(&emulation_running, false);
+	ma_thread_wait(&emulation_thread);
+
 	glDeleteVertexArrays(1, &vao);
 	glDeleteBuffers(1, &vbo);
 	glDeleteBuffers(1, &ebo);
-	glDeleteProgram(shader_program);
+	for (int i = 0; i < VMODE_COUNT; i++) {
+		glDeleteProgram(shader_programs[i]);
+	}
+
+	console_flush();
+	free(rom_image);
+
+	if (audio_open) ma_device_uninit(&audio_device);
+	ma_pcm_rb_uninit(&audio_ring);
 
 	glfwTerminate();
 	return 0;